@@ -2,25 +2,280 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <time.h>
+#ifdef CONCURRENT
+#include <pthread.h>
+#endif
+#ifdef HEAP_PROFILE
+#include <fcntl.h>
+#include <unwind.h>
+#endif
 
-/* Pack a size and allocated bit into a word */
+/* Headers, footers and free list links are one word. -DWIDE_HEADERS makes
+ * words 8 bytes, so blocks and arenas can grow past 4 GB. */
+#ifdef WIDE_HEADERS
+typedef unsigned long long word_t;
+#else
+typedef unsigned int word_t;
+#endif
+#define WSIZE ((int)sizeof(word_t))
+#define MIN_BLOCK (4 * WSIZE)		//header, two links and footer
+
+/* Alignment of every payload, 8 or 16. Blocks are sized in multiples of it
+ * and the first payload of an arena is 4 words in, so all payloads keep it.
+ * -DALIGNMENT=16 gives the alignment the C library promises. */
+#ifndef ALIGNMENT
+#define ALIGNMENT 8
+#endif
+
+/* Block size for a request of size bytes: payload and header rounded up
+ * to a multiple of ALIGNMENT, at least MIN_BLOCK */
+#define ASIZE(size) (((size) + WSIZE <= MIN_BLOCK) ? MIN_BLOCK : ALIGNMENT * (((size) + WSIZE + ALIGNMENT - 1) / ALIGNMENT))
+
+/* Pack a size and allocated bits into a word.
+ * Bit 0 is set if the block is allocated, bit 1 if the block before it is. */
 #define PACK(size, alloc) ((size) | (alloc))
+#define PREV_ALLOC 0x2
 
 /* Read and write a word at address p */
-#define GET(p) (*(unsigned int *)(p))
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+#define GET(p) (*(word_t *)(p))
+#define PUT(p, val) (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7) 
 #define GET_ALLOC(p) (GET(p) & 0x1)
+#define GET_PREV_ALLOC(p) (GET(p) & PREV_ALLOC)
+
+/* Set or clear the prev allocated bit of the header at p. The owner of the
+ * block may read its size from the same word without holding the arena lock. */
+#define SET_PREV_ALLOC(p) __atomic_store_n((word_t *)(p), GET(p) | PREV_ALLOC, __ATOMIC_RELAXED)
+#define CLR_PREV_ALLOC(p) __atomic_store_n((word_t *)(p), GET(p) & ~PREV_ALLOC, __ATOMIC_RELAXED)
+#define GET_SIZE_UNLOCKED(p) (__atomic_load_n((word_t *)(p), __ATOMIC_RELAXED) & ~0x7)
 
-/* Compute address of header and footer */
-#define HDRP(p) ((char *)(p) - 4)
-#define FTRP(p) ((char *)(p) + GET_SIZE(HDRP(p))-8)
+/* Compute address of header and footer.
+ * Only free blocks have a footer, allocated blocks use the whole
+ * block after the header as payload. */
+#define HDRP(p) ((char *)(p) - WSIZE)
+#define FTRP(p) ((char *)(p) + GET_SIZE(HDRP(p)) - 2 * WSIZE)
 
-/* Compute address of next and previous block */
+/* Compute address of next and previous block.
+ * PREV_BLKP is only valid when the previous block is free */
 #define NEXT_BLKP(p) ((char *)(p) + GET_SIZE(HDRP(p)))
-#define PREV_BLKP(p) ((char *)(p) - GET_SIZE(HDRP(p) - 4))
+#define PREV_BLKP(p) ((char *)(p) - GET_SIZE(HDRP(p) - WSIZE))
+
+/* Free blocks keep their free list links in the first two payload words.
+ * Links are stored as offsets from heap_lo so the minimum block stays 4 words */
+#define PRED_LINK(bp) ((char *)(bp))
+#define SUCC_LINK(bp) ((char *)(bp) + WSIZE)
+#define GET_LINK(p) (GET(p) ? heap_lo + GET(p) : NULL)
+#define PUT_LINK(p, bp) PUT(p, (bp) ? (word_t)((char *)(bp) - heap_lo) : 0)
+#define GET_PRED(bp) GET_LINK(PRED_LINK(bp))
+#define GET_SUCC(bp) GET_LINK(SUCC_LINK(bp))
+
+/* Segregated free lists: class c holds free blocks of size [2^(c+4), 2^(c+5)),
+ * the last class holds everything larger */
+#define NUM_CLASSES 20
+
+/* Placement policies, see SetFitPolicy. FIT_POLICY picks the one Init
+ * starts with. Only the first size class searched can hold blocks that are
+ * too small, so the policies differ in how they pick from that class and in
+ * which block of a larger class they take. */
+#define FIT_FIRST 0	//first block that fits, in list order
+#define FIT_NEXT 1	//first block that fits after the one the last search in its class took
+#define FIT_BEST 2	//smallest block that fits
+#define FIT_GOOD 3	//smallest of the first GOOD_FIT_PROBES blocks that fit
+#define FIT_POLICIES 4
+#ifndef FIT_POLICY
+#define FIT_POLICY FIT_FIRST
+#endif
+#ifndef GOOD_FIT_PROBES
+#define GOOD_FIT_PROBES 8
+#endif
+
+/* FreeBatch sorts the blocks of a batch this many at a time, in an array on
+ * its stack, so freeing never allocates */
+#define FREE_BATCH_CHUNK 256
+
+#ifdef SLAB_TIER
+/* Small-object tier: requests of up to SLAB_MAX_SIZE bytes are served from
+ * runs of same-size slots carved out of M1. A run is one allocated block whose
+ * payload starts on a SLAB_RUN_SIZE boundary, so the run owning a slot is
+ * found by masking the slot address. slab_map marks which run-sized windows
+ * of M1 hold a run, which lets Free recognise slab slots in O(1). */
+#define SLAB_MAX_SIZE 64
+#define SLAB_NUM_CLASSES (SLAB_MAX_SIZE / ALIGNMENT)	//slots are multiples of ALIGNMENT
+#define SLAB_RUN_SHIFT 12
+#define SLAB_RUN_SIZE (1 << SLAB_RUN_SHIFT)
+#define SLAB_OF(p) ((struct slab *)((unsigned long long)(p) & ~(unsigned long long)(SLAB_RUN_SIZE - 1)))
+#define SLAB_MAP_IDX(p) (((unsigned long long)(p) >> SLAB_RUN_SHIFT) - ((unsigned long long)heap_lo >> SLAB_RUN_SHIFT))
+
+/* Header at the start of every run, followed by the slots */
+struct slab {
+	struct slab *next;		//partial list links for its slot size
+	struct slab *prev;
+	unsigned int slot_size;
+	unsigned int nslots;
+	unsigned int nfree;
+	unsigned int first_slot;	//offset of slot 0 from the run start
+	unsigned long long bitmap[SLAB_RUN_SIZE / 8 / 64];	//set bit = slot in use
+};
+#endif
+
+/* M1 is a reservation of HEAP_RESERVE_SIZE bytes of address space, split
+ * evenly between the arenas. Init commits the requested size and arenas
+ * grow by at least HEAP_CHUNK_SIZE bytes when no free block fits. Requests of
+ * mmap_threshold bytes or more get their own mapping outside M1. */
+#ifndef HEAP_RESERVE_SIZE
+#ifdef WIDE_HEADERS
+#define HEAP_RESERVE_SIZE (1ULL << 36)
+#else
+#define HEAP_RESERVE_SIZE (1UL << 31)	//free list offsets from heap_lo must fit a word
+#endif
+#endif
+#ifdef HUGE_PAGES
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2UL << 20)
+#endif
+#ifndef HEAP_CHUNK_SIZE
+#define HEAP_CHUNK_SIZE HUGE_PAGE_SIZE
+#endif
+#endif
+#ifndef HEAP_CHUNK_SIZE
+#define HEAP_CHUNK_SIZE (1 << 20)
+#endif
+#ifndef MMAP_THRESHOLD
+#define MMAP_THRESHOLD (256 * 1024)
+#endif
+#define MAPPED_HDR 16		//mapping length is kept this many bytes before the payload
+
+/* Purging: the whole pages inside a free block of purge_threshold bytes or
+ * more are handed back to the OS once the block has been free for
+ * purge_decay ms, so memory freed in a burst doesn't stay resident. The
+ * block keeps its header, links and footer. Every free block of a page or
+ * more keeps a stamp of when it was freed right after the links, so the
+ * threshold can change while blocks are free. Arenas look for expired blocks every
+ * PURGE_INTERVAL lock sections, at most once per purge_decay ms. Freed
+ * pages read back as zeros with MADV_DONTNEED, -DPURGE_ADVICE=MADV_FREE
+ * lets the kernel take them only under memory pressure. */
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD (64 * 1024)
+#endif
+#ifndef PURGE_DECAY
+#define PURGE_DECAY 1000
+#endif
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+#define PURGE_INTERVAL 64
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+/* When the free block bp was last dirtied, in ms, 0 if its pages are purged.
+ * Only blocks of a purge_page or more keep a stamp. */
+#define STAMP(bp) (*(long long *)((char *)(bp) + 2 * WSIZE))
+#define STAMPED(size) ((size) >= purge_page)
+
+/* True if p points into M1 rather than into a direct mapping */
+#define IN_HEAP(p) (((char *)(p) >= heap_lo) && ((char *)(p) < heap_lo + NUM_ARENAS * arena_span))
+
+/* Arenas: Init splits M1 into NUM_ARENAS independent heaps, each with its own
+ * prologue, epilogue, free lists and lock. Threads are attached to arenas
+ * round robin. Without CONCURRENT there is a single arena and no locking. */
+#ifndef CONCURRENT
+#undef NUM_ARENAS
+#define NUM_ARENAS 1
+#elif !defined(NUM_ARENAS)
+#define NUM_ARENAS 8
+#endif
+
+struct arena {
+	char *lo;				//payload of the first block
+	char *hi;				//end of the committed part, just past the epilogue
+	char *end;				//end of the reserved part
+	char *seg_lists[NUM_CLASSES];		//heads of the segregated free lists
+	char *rovers[NUM_CLASSES];		//where the next fit search of each class starts
+#ifdef SLAB_TIER
+	struct slab *slab_partial[SLAB_NUM_CLASSES];	//runs with at least one free slot
+	int slab_empty[SLAB_NUM_CLASSES];		//number of completely free runs kept
+#endif
+#ifdef CONCURRENT
+	pthread_mutex_t lock;
+	char *remote_frees;			//blocks freed by other threads, linked through their payload
+	long lock_contended;			//lock acquisitions that had to wait
+	long lock_wait_cycles;			//clock cycles spent waiting for the lock
+#endif
+
+	/* per arena HEAP CHECKER counters, summed by HEAP_CHECKER */
+	long num_alloc_blks;
+	long num_free_blks;
+	long Rtotal_alloc_bytes;
+	long Ptotal_alloc_bytes;
+	long total_malloc_reqs;
+	long total_free_reqs;
+	long total_req_fails;
+	long fit_searches[FIT_POLICIES];	//fit searches made under each policy
+	long fit_probes[FIT_POLICIES];		//free blocks they looked at
+	long fit_slack[FIT_POLICIES];		//bytes by which the blocks they found exceeded the request
+	long fit_misses[FIT_POLICIES];		//searches that found no block
+	size_t free_bytes;			//bytes of the blocks on the free lists
+	long free_hist[NUM_CLASSES];		//blocks on each free list
+	long peak_alloc_bytes;			//highest Ptotal_alloc_bytes at an unlock
+	long purge_ticks;			//lock sections since Init, paces the purge checks
+	long long purge_clock;			//ms at the last purge check, stamps freed blocks
+	long long last_purge;			//ms at the last purge pass
+	size_t purged_bytes;			//bytes handed back to the OS
+} __attribute__((aligned(64)));
+
+/* Per policy totals returned by FitStats */
+struct fit_stats {
+	long searches;
+	long probes;
+	long slack;
+	long misses;
+};
+
+/* Fragmentation summary returned by HeapStats. Requested sizes aren't kept,
+ * so alloc_bytes counts the payload the allocated blocks can hold, and
+ * internal fragmentation is the share of block bytes lost to headers, rests
+ * too small to split off and unused slab slots. Blocks in thread caches
+ * count as allocated without payload. */
+struct heap_stats {
+	long alloc_blks;
+	long free_blks;
+	size_t alloc_bytes;		//payload bytes of allocated blocks and slots
+	size_t block_bytes;		//bytes of allocated blocks, headers included
+	size_t peak_block_bytes;	//highest block_bytes, summed over the arenas
+	size_t free_bytes;		//bytes of all free blocks
+	size_t largest_free;		//bytes of the largest free block
+	long free_hist[NUM_CLASSES];	//free blocks of each segregated list size class
+	double external_frag;		//1 - largest_free / free_bytes
+	double internal_frag;		//1 - alloc_bytes / block_bytes
+	size_t purged_bytes;		//bytes of free blocks handed back to the OS so far
+};
+
+#ifdef CONCURRENT
+/* Per thread cache of recently freed blocks of the thread's own arena.
+ * Blocks stay marked allocated while cached and are linked through their
+ * first payload word. Bins are indexed by block size / 8, or by slot size
+ * class for slab slots. Counter changes are folded into the arena the next
+ * time the thread takes its lock. */
+#define TCACHE_MAX_SIZE 256
+#define TCACHE_BINS (TCACHE_MAX_SIZE / 8 + 1)
+#define TCACHE_COUNT 16
+
+struct tcache {
+	char *bins[TCACHE_BINS];
+	int counts[TCACHE_BINS];
+	long mallocs;
+	long frees;
+	long alloc_blks;
+	long raw_bytes;
+};
+#endif
 
 /* HEAP CHECKER global variables and macros */
 long num_alloc_blks = 0;
@@ -50,15 +305,209 @@ unsigned long long start, finish;
 long total_malloc_cycles = 0;
 long total_free_cycles = 0;
 
-/* helper function prototypes */
-static void place(void *bp, size_t asize);
-static void *find_first_fit(size_t asize);
-static void *coalesce(void *bp);
+#ifdef LATENCY_STATS
+/* Latency histograms, enabled with -DLATENCY_STATS. Every Malloc and Free is
+ * timed with RDTSC. Bucket b of a histogram counts calls that took
+ * [2^b, 2^(b+1)) cycles, and each operation keeps one histogram per size
+ * class, class c holding requests of [2^c, 2^(c+1)) bytes. */
+#define LAT_BUCKETS 40
+#define LAT_CLASSES 32
+#define LAT_MALLOC 0
+#define LAT_FREE 1
+#define LAT_OPS 2
+
+/* Summary returned by LatencyStats. Percentiles are the upper bound of the
+ * bucket they fall in, capped at max. */
+struct lat_stats {
+	unsigned long long count;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	unsigned long long max;
+};
+
+static unsigned long long lat_hist[LAT_OPS][LAT_CLASSES][LAT_BUCKETS];
+static unsigned long long lat_max[LAT_OPS][LAT_CLASSES];
+static unsigned long long lat_total[LAT_OPS];
+
+static void lat_record(int op, size_t size, unsigned long long cycles);
+void LatencyStats(int op, int cls, struct lat_stats *st);
+
+#define LAT_BEGIN(t) unsigned long long t##_begin, t##_end; RDTSC(t##_begin)
+#define LAT_END(t, op, size) { RDTSC(t##_end); lat_record(op, size, t##_end - t##_begin); }
+#else
+#define LAT_BEGIN(t)
+#define LAT_END(t, op, size)
+#endif
+
+#ifdef HEAP_PROFILE
+/* Sampling heap profiler, enabled with -DHEAP_PROFILE. Every thread counts
+ * down the bytes it allocates and samples the block that takes the count
+ * below zero, then draws the next count from an exponential distribution
+ * with a mean of prof_rate bytes, so each byte is equally likely to be
+ * sampled. A sample records the call stack of the allocation and counts
+ * the block against its call site until Free. Blocks that aren't sampled
+ * cost one subtraction in Malloc and one byte read from prof_homes in Free. */
+#ifndef PROF_RATE
+#define PROF_RATE (512 * 1024)
+#endif
+#define PROF_DEPTH 16			//frames kept of each stack
+#define PROF_SITES 1024			//call sites, samples of further sites are dropped
+#define PROF_SLOT_BITS 15
+#define PROF_SLOTS (1 << PROF_SLOT_BITS)	//live sample table, at most half of it is used
+#define PROF_GONE ((char *)1)		//address of a slot whose sample was freed
+#define PROF_HASH(p) ((unsigned int)(((uintptr_t)(p) * 0x9E3779B97F4A7C15ULL) >> (64 - PROF_SLOT_BITS)))
+
+/* Allocations made from one call stack, returned by ProfileSites. The
+ * sampled counts are what the profiler saw, the estimates weigh each sample
+ * by the inverse of its chance to be sampled. */
+struct prof_site {
+	void *stack[PROF_DEPTH];	//return addresses, innermost first
+	int depth;
+	long live_samples;		//samples not freed yet
+	long alloc_samples;		//all samples since profiling started
+	size_t live_sampled;		//requested bytes of the live samples
+	size_t alloc_sampled;		//requested bytes of all samples
+	double live_bytes;		//estimated bytes of the site's live blocks
+	double alloc_bytes;		//estimated bytes the site allocated
+	double alloc_rate;		//alloc_bytes per second, set by ProfileSites
+};
+
+int ProfileSites(struct prof_site *out, int n);
+
+#define PROF_MALLOC(bp, size) { if ((prof_rate != 0) && ((bp) != NULL) && ((prof_left -= (long)(size)) < 0)) prof_sample(bp, size); }
+#define PROF_FREE(addr) { if (__atomic_load_n(&prof_live, __ATOMIC_RELAXED) != 0) prof_forget(addr); }
+#else
+#define PROF_MALLOC(bp, size)
+#define PROF_FREE(addr)
+#endif
 
 typedef char *addrs_t;
 typedef void *any_t;
 
+/* helper function prototypes */
+static void place(void *bp, size_t asize);
+static void *find_fit(size_t asize);
+static void *search_fit(size_t asize, long *probes);
+static void count_fit(void *bp, size_t asize, long probes);
+static void *find_first_fit(size_t asize, long *probes);
+static void *find_next_fit(size_t asize, long *probes);
+static void *find_best_fit(size_t asize, long limit, long *probes);
+static void *coalesce(void *bp);
+static inline int size_class(size_t size);
+static void insert_free_block(void *bp);
+static void remove_free_block(void *bp);
+static char *align_payload(char *bp, size_t align);
+static void *find_aligned_fit(size_t asize, size_t align);
+static void *place_aligned(void *bp, size_t asize, size_t align);
+static long check_tags(struct arena *ar);
+static struct arena *attach_arena();
+static void lock_arena(struct arena *ar);
+static void unlock_arena(struct arena *ar);
+static addrs_t malloc_request(size_t size);
+static void free_request(addrs_t addr);
+static addrs_t arena_malloc(size_t size);
+static void arena_free(addrs_t addr);
+static size_t usable_size(addrs_t addr);
+static int extend_arena(size_t asize);
+static char *reserve_heap(size_t len);
+static addrs_t map_large(size_t size);
+static addrs_t remap_large(addrs_t addr, size_t size);
+static addrs_t resize_block(addrs_t addr, size_t size);
+static void split_tail(void *bp, size_t asize);
+static void free_sorted(struct arena *ar, addrs_t *own, int m);
+static void sort_addrs(addrs_t *a, int n);
+static long long now_ms();
+static size_t purge_arena(struct arena *ar, int all);
+
 addrs_t baseptr = 0;
+static char *heap_lo = 0;			//start of M1, base for free list offsets
+static size_t arena_span = 0;			//bytes of M1 reserved for each arena
+static size_t mmap_threshold = MMAP_THRESHOLD;
+static int fit_policy = FIT_POLICY;
+static size_t purge_threshold = PURGE_THRESHOLD;
+static long purge_decay = PURGE_DECAY;
+static size_t purge_page = 0;			//purged ranges are whole pages of this size
+static struct arena arenas[NUM_ARENAS];
+static unsigned int next_arena = 0;		//round robin arena assignment
+
+#ifdef CONCURRENT
+static __thread struct arena *cur_arena = NULL;	//arena of the calling thread
+static __thread struct tcache tcache;
+static pthread_key_t tcache_key;
+static pthread_once_t tcache_key_once = PTHREAD_ONCE_INIT;
+
+static int tcache_bin(size_t size);
+static int tcache_block_bin(addrs_t addr);
+static void tcache_flush(int bin, int keep);
+static void tcache_thread_exit(void *unused);
+static void tcache_make_key();
+static void drain_remote_frees(struct arena *ar);
+#else
+static struct arena *cur_arena = NULL;
+#endif
+
+#ifdef SLAB_TIER
+static void *slab_alloc(size_t size);
+static void slab_free(void *p);
+static struct slab *slab_new(int k);
+static void slab_unlink(struct slab *sl, int k);
+
+static unsigned char *slab_map = 0;			//1 if the run window holds a run
+static size_t slab_map_len = 0;
+#endif
+
+#ifdef HEAP_PROFILE
+/* A sampled block in the live sample table, found by probing from the hash
+ * of its address. Free looks it up without the profile lock. */
+struct prof_sample {
+	addrs_t addr;			//NULL if the slot was never used
+	size_t size;			//requested bytes
+	double weight;			//blocks the sample stands for
+	int site;
+};
+
+/* Stack unwound by prof_frame, skipping the first skip frames */
+struct prof_trace {
+	void *stack[PROF_DEPTH];
+	int depth;
+	int skip;
+};
+
+static void prof_sample(addrs_t bp, size_t size);
+static _Unwind_Reason_Code prof_frame(struct _Unwind_Context *ctx, void *arg);
+static void prof_forget(addrs_t addr);
+static void prof_remove(struct prof_sample *s);
+static int prof_find_site(void **stack, int depth);
+static void prof_reset();
+static long prof_interval(size_t rate);
+static double prof_log(double x);
+static double prof_exp_neg(double x);
+static int prof_write(int fd, const char *buf, size_t len);
+
+static size_t prof_rate = PROF_RATE;
+static long prof_live = 0;			//samples not freed yet
+static int prof_max_probe = 0;			//longest probe sequence to a sample
+static long prof_dropped = 0;			//samples without room in the tables
+static long long prof_start = 0;		//ms when profiling started
+static int prof_num_sites = 0;
+static struct prof_site prof_sites[PROF_SITES];
+static short prof_site_index[2 * PROF_SITES];	//site + 1 by stack hash, 0 if empty
+static struct prof_sample prof_table[PROF_SLOTS];
+static unsigned char prof_homes[PROF_SLOTS];	//live samples by hash, 255 sticks
+#ifdef CONCURRENT
+static pthread_mutex_t prof_lock = PTHREAD_MUTEX_INITIALIZER;
+static __thread long prof_left = 0;		//bytes the thread allocates before its next sample
+static __thread unsigned long long prof_seed = 0;
+#define PROF_LOCK() pthread_mutex_lock(&prof_lock)
+#define PROF_UNLOCK() pthread_mutex_unlock(&prof_lock)
+#else
+static long prof_left = 0;
+static unsigned long long prof_seed = 0;
+#define PROF_LOCK()
+#define PROF_UNLOCK()
+#endif
+#endif
 
 /* Initialize M1 region of size bytes */
 void Init(size_t size) {
@@ -69,222 +518,1255 @@ void Init(size_t size) {
 		return;
 	}
 
-	baseptr = (addrs_t)malloc(size);
-	unsigned long long shift = ((unsigned long long)(baseptr) % 8);
-	baseptr = (char *)(baseptr) + shift;				//aligned start address of M1
-		
-	PUT(baseptr, 0);						//alignment padding
-	PUT(baseptr + 4, PACK(8, 1));					//prologue header
-	PUT(baseptr + 8, PACK(8, 1));					//prologue footer
-	PUT(baseptr + 12, PACK(size - 16 - shift, 0));			//header for initial free block chunk
-	PUT(baseptr + size - 8 - shift, PACK(size - 16 - shift, 0));	//footer for intitial free block chunk
-	PUT((baseptr + size - 8 - shift), PACK(0, 1));			//epilogue
-
-	baseptr += 16; 		//baseptr points to payload
-	
-	num_free_blks++;
-	Rtotal_free_bytes += (size - shift - 24);
+	if (size < 32 * NUM_ARENAS) {
+
+		printf("attempt to initialize M1 smaller than %d bytes \n", 32 * NUM_ARENAS);
+		return;
+	}
+
+#ifdef HUGE_PAGES
+	size_t page = HUGE_PAGE_SIZE;		//arenas commit whole huge pages
+#else
+	size_t page = sysconf(_SC_PAGESIZE);
+#endif
+	size_t commit = ((size / NUM_ARENAS) + page - 1) & ~(page - 1);	//initial size of each arena
+
+	if (heap_lo != 0)
+		munmap(heap_lo, NUM_ARENAS * arena_span);
+	arena_span = (HEAP_RESERVE_SIZE / NUM_ARENAS) & ~(page - 1);
+	if (arena_span < commit)
+		arena_span = commit;
+	purge_page = page;
+	if ((purge_threshold != 0) && (purge_threshold < page))	//room for the stamp
+		purge_threshold = page;
+
+	/* reserve address space for every arena, commit only the initial size */
+	baseptr = reserve_heap(NUM_ARENAS * arena_span);
+	if (baseptr == MAP_FAILED) {
+		printf("can't reserve address space for M1 \n");
+		baseptr = heap_lo = 0;
+		return;
+	}
+	heap_lo = baseptr;					//page aligned start address of M1
+
+#ifdef SLAB_TIER
+	/* mapped rather than malloced, so M1 can stand in for malloc */
+	if (slab_map != 0)
+		munmap(slab_map, slab_map_len);
+	slab_map_len = ((NUM_ARENAS * arena_span) >> SLAB_RUN_SHIFT) + 2;
+	slab_map = (unsigned char *)mmap(NULL, slab_map_len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#endif
+
+	/* lay out each arena as its own heap */
+	int i;
+	for (i = 0; i < NUM_ARENAS; i++) {
+		struct arena *ar = &arenas[i];
+		char *lo = heap_lo + i * arena_span;
+
+		memset(ar, 0, sizeof(*ar));
+#ifdef CONCURRENT
+		pthread_mutex_init(&ar->lock, NULL);
+#endif
+		mprotect(lo, commit, PROT_READ | PROT_WRITE);
+		PUT(lo, 0);							//alignment padding
+		PUT(lo + WSIZE, PACK(2 * WSIZE, 1));				//prologue header
+		PUT(lo + 2 * WSIZE, PACK(2 * WSIZE, 1));			//prologue footer
+		PUT(lo + 3 * WSIZE, PACK(commit - 4 * WSIZE, PREV_ALLOC));	//header for initial free block chunk
+		PUT(lo + commit - 2 * WSIZE, PACK(commit - 4 * WSIZE, 0));	//footer for intitial free block chunk
+		PUT(lo + commit - WSIZE, PACK(0, 1));				//epilogue
+
+		ar->lo = lo + 4 * WSIZE;
+		ar->hi = lo + commit;
+		ar->end = lo + arena_span;
+		ar->purge_clock = now_ms();
+		cur_arena = ar;
+		insert_free_block(ar->lo);
+		ar->num_free_blks++;
+	}
+
+	baseptr += 4 * WSIZE; 		//baseptr points to payload
+	cur_arena = NULL;
+	next_arena = 0;
+#ifdef HEAP_PROFILE
+	prof_reset();			//samples of an earlier M1
+#endif
+
+#ifdef CONCURRENT
+	pthread_once(&tcache_key_once, tcache_make_key);
+	memset(&tcache, 0, sizeof(tcache));		//cached blocks of an earlier M1
+#endif
+}
+
+/* Helper function for Init.
+ * Reserves len bytes of address space for M1 without committing any.
+ * With HUGE_PAGES it takes explicit huge pages if the pool holds enough for
+ * the whole reservation, and otherwise asks for transparent huge pages,
+ * which the kernel may ignore. Returns MAP_FAILED if nothing can be reserved. */
+static char *reserve_heap(size_t len) {
+
+	char *m;
+
+#if defined(HUGE_PAGES) && defined(MAP_HUGETLB)
+	m = (char *)mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+	if (m != MAP_FAILED)
+		return m;
+#endif
+	m = (char *)mmap(NULL, len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+#if defined(HUGE_PAGES) && defined(MADV_HUGEPAGE)
+	if (m != MAP_FAILED)
+		madvise(m, len, MADV_HUGEPAGE);
+#endif
+	return m;
 }
 
-/* Allocates size bytes in M1. */
+/* Allocates size bytes in M1 */
 addrs_t Malloc(size_t size) {
-	//RDTSC(start);
-	total_malloc_reqs;
+
+	LAT_BEGIN(t);
+	addrs_t bp = malloc_request(size);
+	LAT_END(t, LAT_MALLOC, size);
+	PROF_MALLOC(bp, size);
+	return bp;
+}
+
+/* Deallocates block at addr in M1 */
+void Free(addrs_t addr) {
+
+#ifdef LATENCY_STATS
+	size_t size = (addr != NULL) ? usable_size(addr) : 0;
+#endif
+	PROF_FREE(addr);
+	LAT_BEGIN(t);
+	free_request(addr);
+	LAT_END(t, LAT_FREE, size);
+}
+
+/* Helper function for Malloc.
+ * With CONCURRENT, small requests are first served from the calling
+ * thread's cache without taking the arena lock. */
+static addrs_t malloc_request(size_t size) {
+
+	struct arena *ar = attach_arena();
+	addrs_t bp;
+
+#ifdef CONCURRENT
+	int bin = tcache_bin(size);
+	if ((bin >= 0) && ((bp = tcache.bins[bin]) != NULL)) {
+		tcache.bins[bin] = *(char **)bp;
+		tcache.counts[bin]--;
+		tcache.mallocs++;
+		tcache.alloc_blks++;
+		tcache.raw_bytes += usable_size(bp);
+		return bp;
+	}
+#endif
+
+	lock_arena(ar);
+	ar->total_malloc_reqs++;
 
 	/* check bad request */
 	if (size == 0) {
 		printf("can't malloc 0 bytes \n");
-		total_req_fails++;
+		ar->total_req_fails++;
+		unlock_arena(ar);
+		return NULL;
+	}
+
+	if (size >= mmap_threshold) {		//own mapping, no arena space used
+		unlock_arena(ar);
+		bp = map_large(size);
+		lock_arena(ar);
+		if (bp != NULL) {
+			ar->num_alloc_blks++;
+			ar->Rtotal_alloc_bytes += usable_size(bp);
+			ar->Ptotal_alloc_bytes += *(size_t *)(bp - MAPPED_HDR);
+		}
+	}
+	else
+		bp = arena_malloc(size);
+	unlock_arena(ar);
+
+#if NUM_ARENAS > 1
+	/* borrow from the other arenas before failing, Free queues the block back to its owner */
+	int i;
+	for (i = 1; (bp == NULL) && (size < mmap_threshold) && (i < NUM_ARENAS); i++) {
+		cur_arena = &arenas[(ar - arenas + i) % NUM_ARENAS];
+		lock_arena(cur_arena);
+		bp = arena_malloc(size);
+		unlock_arena(cur_arena);
+	}
+	cur_arena = ar;
+#endif
+
+	if (bp == NULL) {	//no fit found
+		lock_arena(ar);
+		ar->total_req_fails++;
+		unlock_arena(ar);
+	}
+	return bp;
+}
+
+/* Helper function for Free.
+ * With CONCURRENT, blocks of another arena are queued for their owner,
+ * and small blocks of the own arena go to the thread's cache. */
+static void free_request(addrs_t addr) {
+
+	struct arena *ar = attach_arena();
+
+	if ((addr != NULL) && !IN_HEAP(addr)) {		//direct mapping, give it back to the OS
+		size_t len = *(size_t *)(addr - MAPPED_HDR);
+
+		lock_arena(ar);
+		ar->total_free_reqs++;
+		ar->num_alloc_blks--;
+		ar->Rtotal_alloc_bytes -= len - MAPPED_HDR;
+		ar->Ptotal_alloc_bytes -= len;
+		unlock_arena(ar);
+		munmap(addr - MAPPED_HDR, len);
+		return;
+	}
+
+#ifdef CONCURRENT
+	if (addr != NULL) {
+		struct arena *owner = &arenas[(addr - heap_lo) / arena_span];	//in M1, checked above
+
+		if (owner != ar) {	//push on the owner's remote free queue
+			char *head = __atomic_load_n(&owner->remote_frees, __ATOMIC_RELAXED);
+			do {
+				*(char **)addr = head;
+			} while (!__atomic_compare_exchange_n(&owner->remote_frees, &head, addr, 1,
+				__ATOMIC_RELEASE, __ATOMIC_RELAXED));
+			return;
+		}
+
+		int bin = tcache_block_bin(addr);
+		if (bin >= 0) {
+			*(char **)addr = tcache.bins[bin];
+			tcache.bins[bin] = addr;
+			tcache.frees++;
+			tcache.alloc_blks--;
+			tcache.raw_bytes -= usable_size(addr);
+			if (++tcache.counts[bin] > TCACHE_COUNT) {
+				lock_arena(ar);
+				tcache_flush(bin, TCACHE_COUNT / 2);
+				unlock_arena(ar);
+			}
+			return;
+		}
+	}
+#endif
+
+	lock_arena(ar);
+	arena_free(addr);
+	unlock_arena(ar);
+}
+
+/* Resizes the block at addr to hold size bytes and returns its address.
+ * A block of the caller's arena shrinks in place by splitting off its tail
+ * and grows in place by absorbing a free successor, committing more of the
+ * arena first if the block is the last one. Otherwise the data moves to a
+ * new block. Returns NULL and leaves addr allocated if nothing fits. */
+addrs_t Realloc(addrs_t addr, size_t size) {
+
+	if (addr == NULL)
+		return Malloc(size);
+	if (size == 0) {
+		Free(addr);
+		return NULL;
+	}
+
+	struct arena *ar = attach_arena();
+	addrs_t bp;
+	size_t old_size = usable_size(addr);
+
+	if (!IN_HEAP(addr)) {
+		if ((size >= mmap_threshold) && ((bp = remap_large(addr, size)) != NULL)) {
+			lock_arena(ar);
+			ar->Ptotal_alloc_bytes += usable_size(bp) - old_size;
+			ar->Rtotal_alloc_bytes += usable_size(bp) - old_size;
+			unlock_arena(ar);
+			if (bp != addr) {	//a moved mapping counts as a new block
+				PROF_FREE(addr);
+				PROF_MALLOC(bp, size);
+			}
+			return bp;
+		}
+	}
+	else if (&arenas[(addr - heap_lo) / arena_span] == ar) {
+		lock_arena(ar);
+		bp = resize_block(addr, size);
+		unlock_arena(ar);
+		if (bp != NULL)
+			return bp;
+	}
+
+	/* move to a new block */
+	if ((bp = Malloc(size)) == NULL)
 		return NULL;
+	memcpy(bp, addr, (old_size < size) ? old_size : size);
+	Free(addr);
+	return bp;
+}
+
+/* Helper function for Realloc.
+ * Resizes the block or slot at addr of cur_arena in place. Returns NULL if
+ * it can't hold size bytes without moving. */
+static addrs_t resize_block(addrs_t addr, size_t size){
+
+	struct arena *ar = cur_arena;
+#ifdef SLAB_TIER
+	if (slab_map[SLAB_MAP_IDX(addr)])
+		return (size <= SLAB_OF(addr)->slot_size) ? addr : NULL;
+#endif
+	size_t asize = ASIZE(size);
+	size_t csize = GET_SIZE(HDRP(addr));
+	char *next = NEXT_BLKP(addr);
+
+	if (asize > csize) {
+		/* last block of the arena, commit more so it has a free successor */
+		if ((GET_SIZE(HDRP(next)) == 0) && !extend_arena(asize - csize))
+			return NULL;
+
+		size_t nsize = GET_SIZE(HDRP(next));
+		if (GET_ALLOC(HDRP(next)) || (csize + nsize < asize))
+			return NULL;
+
+		remove_free_block(next);
+		PUT(HDRP(addr), PACK(csize + nsize, GET_PREV_ALLOC(HDRP(addr)) | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(addr)));
+		ar->num_free_blks--;
+		ar->Ptotal_alloc_bytes += nsize;
+		ar->Rtotal_alloc_bytes += nsize;
+	}
+
+	split_tail(addr, asize);
+	return addr;
+}
+
+/* Helper function for Realloc.
+ * Splits the allocated block bp down to asize bytes if the rest makes a
+ * free block of minimum size, and coalesces the rest. */
+static void split_tail(void *bp, size_t asize){
+
+	struct arena *ar = cur_arena;
+	size_t csize = GET_SIZE(HDRP(bp));
+
+	if ((csize - asize) >= MIN_BLOCK) {
+		PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+		char *rest = NEXT_BLKP(bp);
+		PUT(HDRP(rest), PACK(csize - asize, PREV_ALLOC));
+		PUT(FTRP(rest), PACK(csize - asize, 0));
+		coalesce(rest);
+
+		ar->Ptotal_alloc_bytes -= csize - asize;
+		ar->Rtotal_alloc_bytes -= csize - asize;
 	}
+}
 
+/* Helper function for Malloc.
+ * Allocates size bytes in cur_arena, returns NULL if nothing fits. */
+static addrs_t arena_malloc(size_t size) {
+	struct arena *ar = cur_arena;
 	size_t asize;
 	char *bp;
+
+#ifdef SLAB_TIER
+	/* small requests go to the slab tier, falling back to a block if no run fits */
+	if ((size <= SLAB_MAX_SIZE) && ((bp = slab_alloc(size)) != NULL)) {
+		ar->num_alloc_blks++;
+		ar->Rtotal_alloc_bytes += SLAB_OF(bp)->slot_size;
+		return bp;
+	}
+#endif
 	
-	/* adjust for overhead and alignment */
-	if (size <= 8)
-		asize = 16;	
-	
-	else
-		asize = 8 * ((size + 15) / 8);
+	/* adjust for header and alignment */
+	asize = ASIZE(size);
 	
-	if ((bp = find_first_fit(asize)) != NULL){	//found fit
+	if (((bp = find_fit(asize)) != NULL) ||
+		(extend_arena(asize) && ((bp = find_fit(asize)) != NULL))){	//found fit
 
 		place(bp, asize);
 		
-		num_alloc_blks++;
-		Rtotal_alloc_bytes += size;
-
-		/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_malloc_cycles += time;
-	avg_malloc_cycles = total_malloc_cycles / total_malloc_reqs; */
+		ar->num_alloc_blks++;
+		ar->Rtotal_alloc_bytes += GET_SIZE(HDRP(bp)) - WSIZE;
 
 		return bp;
 	
 	}
 	else {	//no fit found
-	
-		total_req_fails++;
 		
-		/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_malloc_cycles += time;
-	avg_malloc_cycles = total_malloc_cycles / total_malloc_reqs; */
-
 		return NULL;
 
 	}
 
 }
 
-/* Deallocates block at addr in M1. */
-void Free(addrs_t addr) {
+/* Helper function for Free.
+ * Deallocates block at addr, which belongs to the calling thread's arena. */
+static void arena_free(addrs_t addr) {
 	
-	//RDTSC(start);
-	total_free_reqs++;
+	struct arena *ar = cur_arena;
+	ar->total_free_reqs++;
 
 	/* check bad requests */
 	if (addr == NULL) {
 		printf("invalid address \n");
-		total_req_fails++;
+		ar->total_req_fails++;
+		return;
+	}
+
+#ifdef SLAB_TIER
+	if (slab_map[SLAB_MAP_IDX(addr)]) {	//slot of a run, no coalescing needed
+		ar->num_alloc_blks--;
+		ar->Rtotal_alloc_bytes -= SLAB_OF(addr)->slot_size;
+		slab_free(addr);
 		return;
 	}
+#endif
 		
 	size_t size = GET_SIZE (HDRP (addr));
 
-	PUT (HDRP (addr), PACK (size, 0));
+	PUT (HDRP (addr), PACK (size, GET_PREV_ALLOC (HDRP (addr))));
 	PUT (FTRP (addr), PACK (size, 0));
 	coalesce (addr);
 	
-	num_alloc_blks--;
-	Rtotal_alloc_bytes -= (size - 8);
-	Ptotal_alloc_bytes -= size;
-	/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_free_cycles += time;
-	avg_free_cycles = total_free_cycles / total_free_reqs;*/ 
+	ar->num_alloc_blks--;
+	ar->Rtotal_alloc_bytes -= (size - WSIZE);
+	ar->Ptotal_alloc_bytes -= size;
 }
 
-/* Helper function for Malloc.
- * Updates size and allocated bit for newly allocated block.
- * Splits block into allocated and free if minimum block size met */
-static void place (void *bp, size_t asize){
-	
-	size_t csize = GET_SIZE (HDRP (bp));
-	if ((csize-asize) >= 16){		//split block and create free block
-		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
-		bp = NEXT_BLKP(bp);
-		PUT(HDRP(bp), PACK(csize-asize, 0));
-		PUT(FTRP(bp), PACK(csize-asize, 0));
-		
-		Ptotal_alloc_bytes += asize;		
-		
+/* Returns the arena of the calling thread, attaching one on first use */
+static struct arena *attach_arena(){
+
+	if (cur_arena == NULL) {
+		cur_arena = &arenas[__atomic_fetch_add(&next_arena, 1, __ATOMIC_RELAXED) % NUM_ARENAS];
+#ifdef CONCURRENT
+		pthread_setspecific(tcache_key, cur_arena);	//flush the cache on thread exit
+#endif
 	}
+	return cur_arena;
+}
 
-	else{					//can't make free block of minimum size
-		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
+/* Takes the lock of ar. With CONCURRENT it also settles the calling
+ * thread's cache counters and frees blocks queued by other threads. */
+static void lock_arena(struct arena *ar){
+#ifdef CONCURRENT
+	if (pthread_mutex_trylock(&ar->lock) != 0) {	//contended, time the wait
+		unsigned long long wait_start, wait_end;
 
-		Ptotal_alloc_bytes += csize;
-		num_free_blks--;
+		RDTSC(wait_start);
+		pthread_mutex_lock(&ar->lock);
+		RDTSC(wait_end);
+		ar->lock_contended++;
+		ar->lock_wait_cycles += wait_end - wait_start;
 	}
+
+	ar->total_malloc_reqs += tcache.mallocs;
+	ar->total_free_reqs += tcache.frees;
+	ar->num_alloc_blks += tcache.alloc_blks;
+	ar->Rtotal_alloc_bytes += tcache.raw_bytes;
+	tcache.mallocs = tcache.frees = tcache.alloc_blks = tcache.raw_bytes = 0;
+
+	if (__atomic_load_n(&ar->remote_frees, __ATOMIC_RELAXED) != NULL)
+		drain_remote_frees(ar);
+#else
+	(void)ar;
+#endif
+}
+
+/* Releases the lock of ar, noting the arena's peak usage and purging
+ * expired free blocks every PURGE_INTERVAL calls first */
+static void unlock_arena(struct arena *ar){
+
+	if (ar->Ptotal_alloc_bytes > ar->peak_alloc_bytes)
+		ar->peak_alloc_bytes = ar->Ptotal_alloc_bytes;
+	if ((purge_threshold != 0) && ((++ar->purge_ticks % PURGE_INTERVAL) == 0))
+		purge_arena(ar, 0);
+#ifdef CONCURRENT
+	pthread_mutex_unlock(&ar->lock);
+#endif
 }
 
 /* Helper function for Malloc.
- * Locates first free block in M1 that fits asize bytes. */
-static void *find_first_fit(size_t asize){
-	void *bp;
-	for (bp = baseptr; GET_SIZE(HDRP(bp))>0; bp = NEXT_BLKP(bp)){
-		
-		if (!GET_ALLOC(HDRP(bp)) && (asize <= GET_SIZE(HDRP(bp))))
-			return bp;
-	}
-	return NULL;
+ * Commits more of cur_arena's reservation so a block of asize bytes fits.
+ * The old epilogue becomes the header of the new free block, which is
+ * coalesced with a free block at the old end. Returns 0 if the
+ * reservation is used up. */
+static int extend_arena(size_t asize){
+
+	struct arena *ar = cur_arena;
+	size_t chunk = (asize + MIN_BLOCK + HEAP_CHUNK_SIZE - 1) & ~(size_t)(HEAP_CHUNK_SIZE - 1);
+
+	if (chunk > (size_t)(ar->end - ar->hi))
+		chunk = ar->end - ar->hi;
+	if ((chunk < asize) || (mprotect(ar->hi, chunk, PROT_READ | PROT_WRITE) != 0))
+		return 0;
+
+	char *bp = ar->hi;
+	PUT(HDRP(bp), PACK(chunk, GET_PREV_ALLOC(HDRP(bp))));	//over the old epilogue
+	PUT(FTRP(bp), PACK(chunk, 0));
+	PUT(HDRP(NEXT_BLKP(bp)), PACK(0, 1));			//new epilogue
+	ar->hi += chunk;
+	coalesce(bp);
+
+	return 1;
 }
 
-/* Helper function for Free.
- * Coalesces contiguous free blocks into single free block. */
-static void *coalesce(void *bp){
+/* Helper function for Malloc.
+ * Serves a large request with its own anonymous mapping. The mapping
+ * length is stored in front of the payload for Free. */
+static addrs_t map_large(size_t size){
 
-	size_t prev_alloc = GET_ALLOC (FTRP (PREV_BLKP (bp)));
-	size_t next_alloc = GET_ALLOC (HDRP (NEXT_BLKP (bp)));
-	size_t size = GET_SIZE (HDRP (bp));
+	size_t page = sysconf(_SC_PAGESIZE);
+	size_t len = (size + MAPPED_HDR + page - 1) & ~(page - 1);
+	char *m = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
 
-	if (prev_alloc && next_alloc) {	/* Case 1 */
-		num_free_blks++;
-		
-		return bp;
-	}
+	if (m == MAP_FAILED)
+		return NULL;
+	*(size_t *)m = len;
+	return m + MAPPED_HDR;
+}
 
-	else if (prev_alloc && !next_alloc) {	/* Case 2 */
-		size += GET_SIZE (HDRP (NEXT_BLKP (bp)));
-		PUT (HDRP (bp), PACK (size, 0));
-		PUT (FTRP (NEXT_BLKP (bp)), PACK (size, 0));
-	}
+/* Helper function for Realloc.
+ * Resizes the direct mapping at addr without moving it. Shrinking unmaps
+ * the tail pages, growing maps the pages right after it if they are free. */
+static addrs_t remap_large(addrs_t addr, size_t size){
 
-	else if (!prev_alloc && next_alloc) {	/* Case 3 */
-		size += GET_SIZE (HDRP (PREV_BLKP (bp)));
-		PUT (FTRP (bp), PACK (size, 0));
-		PUT (HDRP (PREV_BLKP (bp)), PACK (size, 0));
-		bp = PREV_BLKP (bp);
-	}
+	size_t page = sysconf(_SC_PAGESIZE);
+	char *m = addr - MAPPED_HDR;
+	size_t len = *(size_t *)m;
+	size_t need = (size + MAPPED_HDR + page - 1) & ~(page - 1);
 
-	else {						/* Case 4 */
-		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(FTRP(NEXT_BLKP(bp)));
-		PUT(HDRP(PREV_BLKP(bp)), PACK(size, 0));
-		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
-		bp = PREV_BLKP(bp);
-		
-		num_free_blks--;
+	if (need < len)
+		munmap(m + need, len - need);
+	else if (need > len) {
+		char *more = (char *)mmap(m + len, need - len, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+		if (more != m + len) {		//address taken, the kernel put it elsewhere
+			if (more != MAP_FAILED)
+				munmap(more, need - len);
+			return NULL;
+		}
 	}
-	return bp;
+	*(size_t *)m = need;
+	return addr;
 }
 
-/* Copy size bytes of data into allocated region of M2 */
-addrs_t Put(any_t data, size_t size){
-	
-	/* check bad requests */
-	if (baseptr == 0) {
-		printf("M1 uninitialized \n");
-		return NULL;
+/* Sets the request size from which Malloc uses a direct mapping */
+void SetMmapThreshold(size_t threshold) {
+	mmap_threshold = threshold;
+}
+
+/* Sets the size from which free blocks are purged, 0 to never purge, and
+ * how many ms a block stays free before it is. Thresholds below a page are
+ * raised to a page, so every purgeable block has room for its stamp. */
+void SetPurge(size_t threshold, long decay_ms) {
+
+#ifdef HUGE_PAGES
+	size_t page = HUGE_PAGE_SIZE;
+#else
+	size_t page = sysconf(_SC_PAGESIZE);
+#endif
+
+	if ((threshold != 0) && (threshold < page))
+		threshold = page;
+
+	/* unlock_arena reads them under the arena locks */
+#ifdef CONCURRENT
+	int i;
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++)
+		pthread_mutex_lock(&arenas[i].lock);
+#endif
+	purge_threshold = threshold;
+	purge_decay = (decay_ms > 0) ? decay_ms : 0;
+#ifdef CONCURRENT
+	for (i = NUM_ARENAS - 1; (i >= 0) && (baseptr != 0); i--)
+		pthread_mutex_unlock(&arenas[i].lock);
+#endif
+}
+
+/* Hands the pages of every free block of purge_threshold bytes or more back
+ * to the OS now, without waiting for them to decay. Returns the bytes
+ * purged. */
+size_t Purge() {
+
+	size_t purged = 0;
+	int i;
+
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++) {
+		lock_arena(&arenas[i]);
+		if (purge_threshold != 0)
+			purged += purge_arena(&arenas[i], 1);
+		unlock_arena(&arenas[i]);
 	}
-	if (data == NULL) {
-		printf("invalid data");
-		return NULL;
+	return purged;
+}
+
+/* Helper function for unlock_arena and Purge.
+ * Purges the free blocks of ar that have been free for purge_decay ms, or
+ * all of them if all is set, and updates the clock that stamps the blocks
+ * ar frees. Without all, a pass runs at most once per purge_decay ms.
+ * Returns the bytes purged. */
+static size_t purge_arena(struct arena *ar, int all){
+
+	long long now = now_ms();
+	size_t purged = 0;
+	int c;
+
+	ar->purge_clock = now;
+	if (!all && (now - ar->last_purge < purge_decay))
+		return 0;
+	ar->last_purge = now;
+
+	for (c = size_class(purge_threshold); c < NUM_CLASSES; c++) {
+		char *bp;
+
+		for (bp = ar->seg_lists[c]; bp != NULL; bp = GET_SUCC(bp)) {
+			size_t size = GET_SIZE(HDRP(bp));
+			long long stamp;
+
+			if ((size < purge_threshold) || ((stamp = STAMP(bp)) == 0) ||
+				(!all && (now - stamp < purge_decay)))
+				continue;
+
+			/* whole pages between the stamp and the footer */
+			char *lo = (char *)(((unsigned long long)&STAMP(bp) + sizeof(long long) + purge_page - 1) & ~(unsigned long long)(purge_page - 1));
+			char *hi = (char *)((unsigned long long)FTRP(bp) & ~(unsigned long long)(purge_page - 1));
+
+			if ((hi > lo) && (madvise(lo, hi - lo, PURGE_ADVICE) == 0))
+				purged += hi - lo;
+			STAMP(bp) = 0;
+		}
 	}
-	
-	addrs_t bp = Malloc(size);
-	
-	if (bp == NULL) {
-		printf("no fit for data found \n");
-		return NULL;
-	}	
-	
-	char *temp = (char *) data;
-	memcpy(bp, temp, size);
-			
-	return bp;
-	
+	ar->purged_bytes += purged;
+	return purged;
 }
-/* Copies size bytes from address addr in M1 to return_data.
- * Then frees block pointed to by addr */
-void Get(any_t return_data, addrs_t addr, size_t size){
-	
-	/* check bad request */
-	if (baseptr == 0) {
-		printf("M1 uninitialized");
+
+/* Milliseconds on a coarse monotonic clock, never 0 */
+static long long now_ms(){
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+/* Sets the placement policy of Malloc: FIT_FIRST, FIT_NEXT, FIT_BEST or
+ * FIT_GOOD. It applies from the next request on, and Init keeps it. */
+void SetFitPolicy(int policy) {
+
+	if ((policy < 0) || (policy >= FIT_POLICIES)) {
+		printf("invalid fit policy %d \n", policy);
 		return;
 	}
-	if ((addr == NULL) || (return_data == NULL)) {
-		printf("invalid address");
+	fit_policy = policy;
+}
+
+/* Sums the fit searches made under policy over all arenas into st.
+ * Probes per search measure the cost of a policy, slack per search how
+ * closely the blocks it picks fit the requests. */
+void FitStats(int policy, struct fit_stats *st) {
+
+	int i;
+
+	memset(st, 0, sizeof(*st));
+	if ((policy < 0) || (policy >= FIT_POLICIES))
 		return;
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++) {
+		lock_arena(&arenas[i]);
+		st->searches += arenas[i].fit_searches[policy];
+		st->probes += arenas[i].fit_probes[policy];
+		st->slack += arenas[i].fit_slack[policy];
+		st->misses += arenas[i].fit_misses[policy];
+		unlock_arena(&arenas[i]);
 	}
-	
+}
+
+/* Sums the fragmentation statistics of all arenas into st. The counters are
+ * kept up to date by every free list change, only finding the largest free
+ * block walks a list, the highest nonempty one of each arena. */
+void HeapStats(struct heap_stats *st) {
+
+	int i, c;
+
+	memset(st, 0, sizeof(*st));
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++) {
+		struct arena *ar = &arenas[i];
+		char *bp;
+
+		lock_arena(ar);
+		st->alloc_blks += ar->num_alloc_blks;
+		st->alloc_bytes += ar->Rtotal_alloc_bytes;
+		st->block_bytes += ar->Ptotal_alloc_bytes;
+		st->peak_block_bytes += ar->peak_alloc_bytes;
+		st->free_bytes += ar->free_bytes;
+		st->purged_bytes += ar->purged_bytes;
+		for (c = 0; c < NUM_CLASSES; c++) {
+			st->free_hist[c] += ar->free_hist[c];
+			st->free_blks += ar->free_hist[c];
+		}
+		for (c = NUM_CLASSES - 1; (c > 0) && (ar->seg_lists[c] == NULL); c--)
+			;
+		for (bp = ar->seg_lists[c]; bp != NULL; bp = GET_SUCC(bp))
+			if (GET_SIZE(HDRP(bp)) > st->largest_free)
+				st->largest_free = GET_SIZE(HDRP(bp));
+		unlock_arena(ar);
+	}
+	st->external_frag = st->free_bytes ? 1.0 - (double)st->largest_free / st->free_bytes : 0;
+	st->internal_frag = st->block_bytes ? 1.0 - (double)st->alloc_bytes / st->block_bytes : 0;
+}
+
+/* Returns the number of payload bytes of the allocated block or slot at addr */
+static size_t usable_size(addrs_t addr){
+	if (!IN_HEAP(addr))
+		return *(size_t *)(addr - MAPPED_HDR) - MAPPED_HDR;
+#ifdef SLAB_TIER
+	if (slab_map[SLAB_MAP_IDX(addr)])
+		return SLAB_OF(addr)->slot_size;
+#endif
+	return GET_SIZE_UNLOCKED(HDRP(addr)) - WSIZE;
+}
+
+#ifdef CONCURRENT
+/* Returns the cache bin serving a Malloc of size bytes, or -1 */
+static int tcache_bin(size_t size){
+
+	if (size == 0)
+		return -1;
+#ifdef SLAB_TIER
+	if (size <= SLAB_MAX_SIZE)
+		return (size - 1) / ALIGNMENT;
+#endif
+	size_t asize = ASIZE(size);
+	return (asize <= TCACHE_MAX_SIZE) ? (int)(asize >> 3) : -1;
+}
+
+/* Returns the cache bin a freed block or slot at addr belongs in, or -1.
+ * Blocks small enough for the slab tier are fallbacks and are not cached,
+ * so their bins never mix with slot bins. */
+static int tcache_block_bin(addrs_t addr){
+#ifdef SLAB_TIER
+	if (slab_map[SLAB_MAP_IDX(addr)])
+		return (SLAB_OF(addr)->slot_size / ALIGNMENT) - 1;
+#endif
+	size_t size = GET_SIZE_UNLOCKED(HDRP(addr));
+#ifdef SLAB_TIER
+	if (size <= ASIZE(SLAB_MAX_SIZE))
+		return -1;
+#endif
+	return (size <= TCACHE_MAX_SIZE) ? (int)(size >> 3) : -1;
+}
+
+/* Hands all but keep blocks of a cache bin back to the arena.
+ * The arena lock must be held. */
+static void tcache_flush(int bin, int keep){
+
+	while (tcache.counts[bin] > keep) {
+		char *bp = tcache.bins[bin];
+
+		tcache.bins[bin] = *(char **)bp;
+		tcache.counts[bin]--;
+
+		/* undo the cache's counting, arena_free counts the block again */
+		tcache.frees--;
+		tcache.alloc_blks++;
+		tcache.raw_bytes += usable_size(bp);
+		cur_arena->total_free_reqs += tcache.frees;
+		cur_arena->num_alloc_blks += tcache.alloc_blks;
+		cur_arena->Rtotal_alloc_bytes += tcache.raw_bytes;
+		tcache.frees = tcache.alloc_blks = tcache.raw_bytes = 0;
+		arena_free(bp);
+	}
+}
+
+/* Returns the cached blocks of an exiting thread to its arena */
+static void tcache_thread_exit(void *unused){
+
+	int bin;
+
+	(void)unused;
+
+	if (cur_arena == NULL)
+		return;
+	lock_arena(cur_arena);
+	for (bin = 0; bin < TCACHE_BINS; bin++)
+		tcache_flush(bin, 0);
+	unlock_arena(cur_arena);
+}
+
+static void tcache_make_key(){
+	pthread_key_create(&tcache_key, tcache_thread_exit);
+}
+
+/* Frees the blocks other threads queued on ar. The arena lock must be held. */
+static void drain_remote_frees(struct arena *ar){
+
+	char *bp = __atomic_exchange_n(&ar->remote_frees, NULL, __ATOMIC_ACQUIRE);
+	struct arena *self = cur_arena;
+
+	cur_arena = ar;
+	while (bp != NULL) {
+		char *next = *(char **)bp;
+		arena_free(bp);
+		bp = next;
+	}
+	cur_arena = self;
+}
+#endif
+
+/* Helper function for Malloc.
+ * Updates size and allocated bits for newly allocated block.
+ * Splits block into allocated and free if minimum block size met */
+static void place (void *bp, size_t asize){
+	
+	size_t csize = GET_SIZE (HDRP (bp));
+	size_t prev_alloc = GET_PREV_ALLOC (HDRP (bp));
+	remove_free_block(bp);
+
+	if ((csize-asize) >= MIN_BLOCK){	//split block and create free block
+		long long stamp = STAMPED(csize) ? STAMP(bp) : 0;
+
+		PUT(HDRP(bp), PACK(asize, prev_alloc | 1));
+		bp = NEXT_BLKP(bp);
+		PUT(HDRP(bp), PACK(csize-asize, PREV_ALLOC));
+		PUT(FTRP(bp), PACK(csize-asize, 0));
+		insert_free_block(bp);
+		if (STAMPED(csize - asize))		//the rest is as clean as the block was
+			STAMP(bp) = stamp;
+		
+		cur_arena->Ptotal_alloc_bytes += asize;		
+		
+	}
+
+	else{					//can't make free block of minimum size
+		PUT(HDRP(bp), PACK(csize, prev_alloc | 1));
+		SET_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+
+		cur_arena->Ptotal_alloc_bytes += csize;
+		cur_arena->num_free_blks--;
+	}
+}
+
+/* Helper function for Malloc.
+ * Locates a free block that fits asize bytes with the placement policy in
+ * use and counts the search in the policy's statistics. */
+static void *find_fit(size_t asize){
+
+	long probes = 0;
+	char *bp = search_fit(asize, &probes);
+
+	count_fit(bp, asize, probes);
+	return bp;
+}
+
+/* Helper function for find_fit and MallocBatch.
+ * Locates a free block that fits asize bytes with the placement policy in
+ * use, adding the free blocks looked at to probes. */
+static void *search_fit(size_t asize, long *probes){
+
+	char *bp;
+
+	switch (fit_policy) {
+	case FIT_NEXT:
+		bp = find_next_fit(asize, probes);
+		break;
+	case FIT_BEST:
+		bp = find_best_fit(asize, -1, probes);
+		break;
+	case FIT_GOOD:
+		bp = find_best_fit(asize, GOOD_FIT_PROBES, probes);
+		break;
+	default:
+		bp = find_first_fit(asize, probes);
+	}
+	return bp;
+}
+
+/* Helper function for find_fit and MallocBatch.
+ * Adds a search for asize bytes that found bp, or nothing if bp is NULL,
+ * after probes free blocks to the statistics of the policy in use. */
+static void count_fit(void *bp, size_t asize, long probes){
+
+	cur_arena->fit_searches[fit_policy]++;
+	cur_arena->fit_probes[fit_policy] += probes;
+	if (bp != NULL)
+		cur_arena->fit_slack[fit_policy] += GET_SIZE(HDRP(bp)) - asize;
+	else
+		cur_arena->fit_misses[fit_policy]++;
+}
+
+/* Helper function for find_fit.
+ * Locates first free block that fits asize bytes, starting at the size class
+ * of asize. Every block in a larger class fits, so only the first class
+ * searched may need more than one step. */
+static void *find_first_fit(size_t asize, long *probes){
+	int c;
+	char *bp;
+	for (c = size_class(asize); c < NUM_CLASSES; c++) {
+		for (bp = cur_arena->seg_lists[c]; bp != NULL; bp = GET_SUCC(bp)) {
+
+			(*probes)++;
+			if (asize <= GET_SIZE(HDRP(bp)))
+				return bp;
+		}
+	}
+	return NULL;
+}
+
+/* Helper function for find_fit.
+ * Like find_first_fit, but each class is searched from its rover, the block
+ * after the one last taken from it, wrapping around to the head. Blocks
+ * taken off a list move its rover on, so the rover survives coalesce. */
+static void *find_next_fit(size_t asize, long *probes){
+	int c;
+	char *bp;
+	for (c = size_class(asize); c < NUM_CLASSES; c++) {
+		char *start = (cur_arena->rovers[c] != NULL) ? cur_arena->rovers[c] : cur_arena->seg_lists[c];
+
+		for (bp = start; bp != NULL; ) {
+			(*probes)++;
+			if (asize <= GET_SIZE(HDRP(bp))) {
+				cur_arena->rovers[c] = bp;	//place takes bp off the list, moving the rover past it
+				return bp;
+			}
+			if ((bp = GET_SUCC(bp)) == NULL)	//wrap around
+				bp = cur_arena->seg_lists[c];
+			if (bp == start)
+				break;
+		}
+	}
+	return NULL;
+}
+
+/* Helper function for find_fit.
+ * Locates the smallest free block that fits asize bytes. Blocks of a larger
+ * class are all larger than the blocks of a smaller one, so only the first
+ * class with a fit is searched. With limit >= 0 the search stops after
+ * limit fits have been seen, a good fit rather than the best. An exact fit
+ * ends it right away. */
+static void *find_best_fit(size_t asize, long limit, long *probes){
+	int c;
+	char *bp;
+	for (c = size_class(asize); c < NUM_CLASSES; c++) {
+		char *best = NULL;
+		long fits = 0;
+
+		for (bp = cur_arena->seg_lists[c]; bp != NULL; bp = GET_SUCC(bp)) {
+			size_t size = GET_SIZE(HDRP(bp));
+
+			(*probes)++;
+			if (asize > size)
+				continue;
+			if ((best == NULL) || (size < GET_SIZE(HDRP(best))))
+				best = bp;
+			if ((size == asize) || (++fits == limit))
+				break;
+		}
+		if (best != NULL)
+			return best;
+	}
+	return NULL;
+}
+
+/* Helper function for Free.
+ * Coalesces contiguous free blocks into single free block
+ * and puts the result on its free list. The block before a coalesced
+ * block is always allocated, the block after it is told it no longer is. */
+static void *coalesce(void *bp){
+
+	size_t prev_alloc = GET_PREV_ALLOC (HDRP (bp));
+	size_t next_alloc = GET_ALLOC (HDRP (NEXT_BLKP (bp)));
+	size_t size = GET_SIZE (HDRP (bp));
+
+	if (prev_alloc && next_alloc) {	/* Case 1 */
+		cur_arena->num_free_blks++;
+	}
+
+	else if (prev_alloc && !next_alloc) {	/* Case 2 */
+		remove_free_block(NEXT_BLKP(bp));
+		size += GET_SIZE (HDRP (NEXT_BLKP (bp)));
+		PUT (HDRP (bp), PACK (size, PREV_ALLOC));
+		PUT (FTRP (bp), PACK (size, 0));
+	}
+
+	else if (!prev_alloc && next_alloc) {	/* Case 3 */
+		remove_free_block(PREV_BLKP(bp));
+		size += GET_SIZE (HDRP (PREV_BLKP (bp)));
+		PUT (FTRP (bp), PACK (size, 0));
+		PUT (HDRP (PREV_BLKP (bp)), PACK (size, PREV_ALLOC));
+		bp = PREV_BLKP (bp);
+	}
+
+	else {						/* Case 4 */
+		remove_free_block(PREV_BLKP(bp));
+		remove_free_block(NEXT_BLKP(bp));
+		size += GET_SIZE(HDRP(PREV_BLKP(bp))) + GET_SIZE(HDRP(NEXT_BLKP(bp)));
+		PUT(HDRP(PREV_BLKP(bp)), PACK(size, PREV_ALLOC));
+		PUT(FTRP(NEXT_BLKP(bp)), PACK(size, 0));
+		bp = PREV_BLKP(bp);
+		
+		cur_arena->num_free_blks--;
+	}
+
+	CLR_PREV_ALLOC(HDRP(NEXT_BLKP(bp)));
+	insert_free_block(bp);
+	if (STAMPED(size))
+		STAMP(bp) = cur_arena->purge_clock;
+	return bp;
+}
+
+/* Returns the segregated list index for a block of size bytes */
+static inline int size_class(size_t size){
+
+	int c = (63 - __builtin_clzll((unsigned long long)size)) - 4;
+	return (c < NUM_CLASSES) ? c : NUM_CLASSES - 1;
+}
+
+/* Puts free block bp on the list for its size class.
+ * Lists are LIFO unless ADDRESS_ORDERED is defined, in which case each class
+ * is kept sorted by address and FIT_FIRST is a true first fit. */
+static void insert_free_block(void *bp){
+
+	int c = size_class(GET_SIZE(HDRP(bp)));
+	char **head = &cur_arena->seg_lists[c];
+	char *pred = NULL;
+	char *succ = *head;
+
+	cur_arena->free_hist[c]++;
+	cur_arena->free_bytes += GET_SIZE(HDRP(bp));
+
+#ifdef ADDRESS_ORDERED
+	while ((succ != NULL) && (succ < (char *)bp)) {
+		pred = succ;
+		succ = GET_SUCC(succ);
+	}
+#endif
+
+	PUT_LINK(PRED_LINK(bp), pred);
+	PUT_LINK(SUCC_LINK(bp), succ);
+	if (succ != NULL)
+		PUT_LINK(PRED_LINK(succ), bp);
+	if (pred != NULL)
+		PUT_LINK(SUCC_LINK(pred), bp);
+	else
+		*head = bp;
+}
+
+/* Takes free block bp off the list for its size class, moving the class's
+ * next fit rover on if it was there */
+static void remove_free_block(void *bp){
+
+	int c = size_class(GET_SIZE(HDRP(bp)));
+	char *pred = GET_PRED(bp);
+	char *succ = GET_SUCC(bp);
+
+	cur_arena->free_hist[c]--;
+	cur_arena->free_bytes -= GET_SIZE(HDRP(bp));
+	if (cur_arena->rovers[c] == bp)
+		cur_arena->rovers[c] = succ;
+	if (pred != NULL)
+		PUT_LINK(SUCC_LINK(pred), succ);
+	else
+		cur_arena->seg_lists[c] = succ;
+	if (succ != NULL)
+		PUT_LINK(PRED_LINK(succ), pred);
+}
+
+/* Returns the first payload address at or after bp that is a multiple of
+ * align and leaves room for a minimum size free block in front of it */
+static char *align_payload(char *bp, size_t align){
+
+	char *a = (char *)(((unsigned long long)bp + align - 1) & ~(unsigned long long)(align - 1));
+	while ((a != bp) && ((size_t)(a - bp) < MIN_BLOCK))
+		a += align;
+	return a;
+}
+
+/* Locates first free block that can hold asize bytes at a payload address
+ * that is a multiple of align */
+static void *find_aligned_fit(size_t asize, size_t align){
+	int c;
+	char *bp;
+	for (c = size_class(asize); c < NUM_CLASSES; c++) {
+		for (bp = cur_arena->seg_lists[c]; bp != NULL; bp = GET_SUCC(bp)) {
+
+			if ((size_t)(align_payload(bp, align) - bp) + asize <= GET_SIZE(HDRP(bp)))
+				return bp;
+		}
+	}
+	return NULL;
+}
+
+/* Places an asize block at the first aligned payload address in free block bp.
+ * The leading padding is split off as its own free block. */
+static void *place_aligned(void *bp, size_t asize, size_t align){
+
+	char *a = align_payload(bp, align);
+	if (a != (char *)bp) {
+		size_t csize = GET_SIZE(HDRP(bp));
+		size_t lead = a - (char *)bp;
+		long long stamp = STAMPED(csize) ? STAMP(bp) : 0;
+
+		remove_free_block(bp);
+		PUT(HDRP(bp), PACK(lead, GET_PREV_ALLOC(HDRP(bp))));
+		PUT(FTRP(bp), PACK(lead, 0));
+		insert_free_block(bp);
+		PUT(HDRP(a), PACK(csize - lead, 0));
+		PUT(FTRP(a), PACK(csize - lead, 0));
+		insert_free_block(a);
+		if (STAMPED(csize - lead))
+			STAMP(a) = stamp;
+
+		cur_arena->num_free_blks++;
+	}
+	place(a, asize);
+	return a;
+}
+
+#ifdef SLAB_TIER
+/* Helper function for Malloc.
+ * Hands out the lowest free slot of a partial run for size, creating a run
+ * from M1 when the class has none. */
+static void *slab_alloc(size_t size){
+
+	int k = (size - 1) / ALIGNMENT;
+	struct slab *sl = cur_arena->slab_partial[k];
+
+	if ((sl == NULL) && ((sl = slab_new(k)) == NULL))
+		return NULL;
+	if (sl->nfree == sl->nslots)
+		cur_arena->slab_empty[k]--;
+
+	unsigned int w = 0;
+	while (sl->bitmap[w] == ~0ULL)
+		w++;
+	unsigned int i = (w << 6) + __builtin_ctzll(~sl->bitmap[w]);
+	sl->bitmap[w] |= 1ULL << (i & 63);
+
+	if (--sl->nfree == 0)
+		slab_unlink(sl, k);
+
+	return (char *)sl + sl->first_slot + (size_t)i * sl->slot_size;
+}
+
+/* Helper function for Free.
+ * Clears the slot's bit. A run that becomes empty is kept if it is the only
+ * empty one of its class, otherwise it is handed back to M1. */
+static void slab_free(void *p){
+
+	struct slab *sl = SLAB_OF(p);
+	int k = (sl->slot_size / ALIGNMENT) - 1;
+	unsigned int i = ((char *)p - ((char *)sl + sl->first_slot)) / sl->slot_size;
+
+	sl->bitmap[i >> 6] &= ~(1ULL << (i & 63));
+
+	if (sl->nfree++ == 0) {		//was full, back on the partial list
+		sl->prev = NULL;
+		sl->next = cur_arena->slab_partial[k];
+		if (sl->next != NULL)
+			sl->next->prev = sl;
+		cur_arena->slab_partial[k] = sl;
+	}
+
+	if (sl->nfree == sl->nslots) {
+		if (cur_arena->slab_empty[k] == 0) {
+			cur_arena->slab_empty[k]++;
+			return;
+		}
+		size_t size = GET_SIZE(HDRP(sl));
+
+		slab_unlink(sl, k);
+		slab_map[SLAB_MAP_IDX(sl)] = 0;
+		PUT(HDRP(sl), PACK(size, GET_PREV_ALLOC(HDRP(sl))));
+		PUT(FTRP(sl), PACK(size, 0));
+		coalesce(sl);
+
+		cur_arena->Ptotal_alloc_bytes -= size;
+	}
+}
+
+/* Carves a new run of slots for class k out of M1 */
+static struct slab *slab_new(int k){
+
+	char *bp = find_aligned_fit(SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+	if (bp == NULL)
+		return NULL;
+
+	struct slab *sl = (struct slab *)place_aligned(bp, SLAB_RUN_SIZE, SLAB_RUN_SIZE);
+	unsigned int i;
+
+	slab_map[SLAB_MAP_IDX(sl)] = 1;
+	sl->slot_size = (k + 1) * ALIGNMENT;
+	sl->first_slot = (sizeof(struct slab) + ALIGNMENT - 1) & ~(ALIGNMENT - 1);
+	sl->nslots = (GET_SIZE(HDRP(sl)) - WSIZE - sl->first_slot) / sl->slot_size;
+	sl->nfree = sl->nslots;
+	memset(sl->bitmap, 0, sizeof(sl->bitmap));
+	for (i = sl->nslots; i < sizeof(sl->bitmap) * 8; i++)	//slots past the end are never free
+		sl->bitmap[i >> 6] |= 1ULL << (i & 63);
+
+	sl->prev = NULL;
+	sl->next = cur_arena->slab_partial[k];
+	if (sl->next != NULL)
+		sl->next->prev = sl;
+	cur_arena->slab_partial[k] = sl;
+	cur_arena->slab_empty[k]++;
+
+	return sl;
+}
+
+/* Takes run sl off the partial list of class k */
+static void slab_unlink(struct slab *sl, int k){
+
+	if (sl->prev != NULL)
+		sl->prev->next = sl->next;
+	else
+		cur_arena->slab_partial[k] = sl->next;
+	if (sl->next != NULL)
+		sl->next->prev = sl->prev;
+}
+#endif
+
+/* Copy size bytes of data into allocated region of M2 */
+addrs_t Put(any_t data, size_t size){
+	
+	/* check bad requests */
+	if (baseptr == 0) {
+		printf("M1 uninitialized \n");
+		return NULL;
+	}
+	if (data == NULL) {
+		printf("invalid data");
+		return NULL;
+	}
+	
+	addrs_t bp = Malloc(size);
+	
+	if (bp == NULL) {
+		printf("no fit for data found \n");
+		return NULL;
+	}	
+	
+	char *temp = (char *) data;
+	memcpy(bp, temp, size);
+			
+	return bp;
+	
+}
+/* Copies size bytes from address addr in M1 to return_data.
+ * Then frees block pointed to by addr */
+void Get(any_t return_data, addrs_t addr, size_t size){
+	
+	/* check bad request */
+	if (baseptr == 0) {
+		printf("M1 uninitialized");
+		return;
+	}
+	if ((addr == NULL) || (return_data == NULL)) {
+		printf("invalid address");
+		return;
+	}
+	
 	char *temp = (char *) return_data;
 	memcpy(temp, addr, size);
 			
@@ -292,8 +1774,306 @@ void Get(any_t return_data, addrs_t addr, size_t size){
 	
 }
 
-/* Prints heap checker statistics */
+/* Zero-copy counterpart of Put. Returns a block of size bytes for the caller
+ * to write the record into directly, or NULL if nothing fits. */
+addrs_t Reserve(size_t size){
+
+	if (baseptr == 0) {
+		printf("M1 uninitialized \n");
+		return NULL;
+	}
+	return Malloc(size);
+}
+
+/* Finishes a Reserve once size bytes of it are written. A smaller size
+ * gives the rest of the block back, size 0 frees the block. Returns the
+ * address of the record, which stays at addr unless the block couldn't be
+ * shrunk in place. */
+addrs_t Commit(addrs_t addr, size_t size){
+
+	if (addr == NULL) {
+		printf("invalid address");
+		return NULL;
+	}
+	if (size < usable_size(addr))
+		return Realloc(addr, size);
+	return addr;
+}
+
+/* Zero-copy counterpart of Get. Returns the record at addr to be read in
+ * place until Release. */
+any_t Borrow(addrs_t addr){
+
+	if ((baseptr == 0) || (addr == NULL)) {
+		printf("invalid address");
+		return NULL;
+	}
+	return (any_t)addr;
+}
+
+/* Ends a Borrow of the record at addr and frees its block without copying */
+void Release(addrs_t addr){
+
+	Free(addr);
+}
+
+/* Allocates size bytes at an address that is a multiple of align, a power
+ * of two up to the page size. The block is cut out of a free block whose
+ * padding in front of the aligned payload is split off as a free block.
+ * Large requests get a direct mapping if its 16 byte header keeps them
+ * aligned. Free and Realloc take the block like any other, but a block
+ * Realloc moves is only ALIGNMENT aligned. */
+addrs_t MallocAligned(size_t size, size_t align){
+
+	struct arena *ar = attach_arena();
+	char *bp = NULL;
+
+	if ((align == 0) || (align & (align - 1)) || (align > (size_t)sysconf(_SC_PAGESIZE))) {
+		printf("invalid alignment %zu \n", align);
+		return NULL;
+	}
+	if ((align <= ALIGNMENT) || ((size >= mmap_threshold) && (align <= MAPPED_HDR)))
+		return Malloc(size);
+
+	LAT_BEGIN(t);
+	lock_arena(ar);
+	ar->total_malloc_reqs++;
+	if (size == 0)
+		printf("can't malloc 0 bytes \n");
+	else {
+		size_t asize = ASIZE(size);
+
+		if (((bp = find_aligned_fit(asize, align)) != NULL) ||
+			(extend_arena(asize + align + MIN_BLOCK) && ((bp = find_aligned_fit(asize, align)) != NULL))) {
+			bp = place_aligned(bp, asize, align);
+			ar->num_alloc_blks++;
+			ar->Rtotal_alloc_bytes += GET_SIZE(HDRP(bp)) - WSIZE;
+		}
+	}
+	if (bp == NULL)
+		ar->total_req_fails++;
+	unlock_arena(ar);
+	LAT_END(t, LAT_MALLOC, size);
+	PROF_MALLOC(bp, size);
+	return bp;
+}
+
+/* Allocates n blocks of size bytes into out and returns how many were
+ * allocated. Each fit search looks for room for all remaining blocks, and the
+ * free block found is cut into as many blocks as fit, all under one lock.
+ * Blocks the batch can't place are left to Malloc. */
+int MallocBatch(size_t size, int n, addrs_t *out){
+
+	struct arena *ar = attach_arena();
+	size_t asize;
+	int i = 0;
+
+	if (baseptr == 0) {
+		printf("M1 uninitialized \n");
+		return 0;
+	}
+
+	/* adjust for header and alignment */
+	asize = ASIZE(size);
+
+#ifdef SLAB_TIER
+	if (size <= SLAB_MAX_SIZE)		//slab slots, no fit search to share
+		asize = 0;
+#endif
+	if ((size == 0) || (size >= mmap_threshold))
+		asize = 0;
+
+	lock_arena(ar);
+	while ((asize != 0) && (i < n)) {
+
+		size_t run = asize * (n - i);
+		long probes = 0;
+		char *bp = search_fit(run, &probes);
+
+		/* a miss for the whole run is expected, only count one for a block */
+		if (bp != NULL)
+			count_fit(bp, run, probes);
+		else if (((bp = find_fit(asize)) == NULL) &&
+			(extend_arena(run) || extend_arena(asize)))
+			bp = find_fit(asize);
+		if (bp == NULL)
+			break;
+
+		size_t k = GET_SIZE(HDRP(bp)) / asize;
+		if (k > (size_t)(n - i))
+			k = n - i;
+		place(bp, k * asize);
+
+		/* cut the run into k blocks, the last one keeps any rest place left */
+		size_t rest = GET_SIZE(HDRP(bp));
+		ar->total_malloc_reqs += k;
+		ar->num_alloc_blks += k;
+		ar->Rtotal_alloc_bytes += rest - k * WSIZE;
+		for (; k > 1; k--) {
+			PUT(HDRP(bp), PACK(asize, GET_PREV_ALLOC(HDRP(bp)) | 1));
+			out[i++] = bp;
+			bp += asize;
+			rest -= asize;
+			PUT(HDRP(bp), PACK(rest, PREV_ALLOC | 1));
+		}
+		out[i++] = bp;
+	}
+	unlock_arena(ar);
+#ifdef HEAP_PROFILE
+	int j;
+	for (j = 0; j < i; j++)
+		PROF_MALLOC(out[j], size);
+#endif
+
+	while ((i < n) && ((out[i] = Malloc(size)) != NULL))
+		i++;
+	return i;
+}
+
+/* Deallocates the n blocks in addrs. Blocks of the caller's arena are
+ * sorted by address FREE_BATCH_CHUNK at a time, and each run of adjacent
+ * blocks is merged and coalesced once, all under one lock per chunk. Other
+ * blocks go through Free. */
+void FreeBatch(addrs_t *addrs, int n){
+
+	struct arena *ar = attach_arena();
+	addrs_t own[FREE_BATCH_CHUNK];
+	int i = 0;
+
+	while (i < n) {
+		int m = 0;
+
+		for (; (i < n) && (m < FREE_BATCH_CHUNK); i++) {
+			addrs_t addr = addrs[i];
+
+			if ((addr == NULL) || !IN_HEAP(addr) ||
+				(&arenas[(addr - heap_lo) / arena_span] != ar)) {
+				Free(addr);
+				continue;
+			}
+#ifdef SLAB_TIER
+			if (slab_map[SLAB_MAP_IDX(addr)]) {
+				Free(addr);
+				continue;
+			}
+#endif
+			PROF_FREE(addr);
+			own[m++] = addr;
+		}
+		sort_addrs(own, m);
+		free_sorted(ar, own, m);
+	}
+}
+
+/* Helper function for FreeBatch.
+ * Frees the m blocks of arena ar in own, sorted by address. Each run of
+ * adjacent blocks is merged and coalesced once. */
+static void free_sorted(struct arena *ar, addrs_t *own, int m){
+
+	int i;
+
+	lock_arena(ar);
+	ar->total_free_reqs += m;
+	for (i = 0; i < m; ) {
+
+		char *bp = own[i];
+		size_t size = 0;
+
+		/* merge the run of adjacent blocks starting at bp */
+		do {
+			size_t bsize = GET_SIZE(HDRP(own[i]));
+			size += bsize;
+			ar->num_alloc_blks--;
+			ar->Rtotal_alloc_bytes -= (bsize - WSIZE);
+			ar->Ptotal_alloc_bytes -= bsize;
+			i++;
+		} while ((i < m) && (own[i] == bp + size));
+
+		PUT(HDRP(bp), PACK(size, GET_PREV_ALLOC(HDRP(bp))));
+		PUT(FTRP(bp), PACK(size, 0));
+		coalesce(bp);
+	}
+	unlock_arena(ar);
+}
+
+/* Copies n records of size bytes, stored back to back at data, into blocks
+ * allocated with MallocBatch. Returns how many were stored in out. */
+int PutBatch(any_t data, size_t size, int n, addrs_t *out){
+
+	if (data == NULL) {
+		printf("invalid data");
+		return 0;
+	}
+
+	int i, got = MallocBatch(size, n, out);
+	char *temp = (char *) data;
+
+	for (i = 0; i < got; i++)
+		memcpy(out[i], temp + i * size, size);
+	return got;
+}
+
+/* Helper function for FreeBatch.
+ * Sorts the n blocks in a by address. An insertion sort needs no memory and
+ * is quick on the nearly sorted batches MallocBatch hands out. */
+static void sort_addrs(addrs_t *a, int n){
+
+	int i, j;
+
+	for (i = 1; i < n; i++) {
+		addrs_t x = a[i];
+
+		for (j = i; (j > 0) && (a[j - 1] > x); j--)
+			a[j] = a[j - 1];
+		a[j] = x;
+	}
+}
+
+/* Prints heap checker statistics, summed over all arenas */
 void HEAP_CHECKER() {
+
+	long tag_errors = 0;
+#ifdef CONCURRENT
+	long contended = 0, wait_cycles = 0;
+#endif
+	struct fit_stats fs_fit;
+	struct heap_stats hs;
+	int i;
+
+	num_alloc_blks = num_free_blks = Rtotal_alloc_bytes = Ptotal_alloc_bytes = 0;
+	total_malloc_reqs = total_free_reqs = total_req_fails = 0;
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++) {
+		struct arena *ar = &arenas[i];
+
+		lock_arena(ar);
+		num_alloc_blks += ar->num_alloc_blks;
+		num_free_blks += ar->num_free_blks;
+		Rtotal_alloc_bytes += ar->Rtotal_alloc_bytes;
+		Ptotal_alloc_bytes += ar->Ptotal_alloc_bytes;
+		total_malloc_reqs += ar->total_malloc_reqs;
+		total_free_reqs += ar->total_free_reqs;
+		total_req_fails += ar->total_req_fails;
+		tag_errors += check_tags(ar);
+#ifdef CONCURRENT
+		contended += ar->lock_contended;
+		wait_cycles += ar->lock_wait_cycles;
+#endif
+		unlock_arena(ar);
+	}
+	HeapStats(&hs);
+	Atotal_free_bytes = hs.free_bytes;
+	Rtotal_free_bytes = hs.free_bytes - hs.free_blks * WSIZE;	//what Malloc could hand out of them
+
+#ifdef LATENCY_STATS
+	struct lat_stats ms, fs;
+	LatencyStats(LAT_MALLOC, -1, &ms);
+	LatencyStats(LAT_FREE, -1, &fs);
+	total_malloc_cycles = lat_total[LAT_MALLOC];
+	total_free_cycles = lat_total[LAT_FREE];
+	total_cycles = total_malloc_cycles + total_free_cycles;
+	avg_malloc_cycles = ms.count ? total_malloc_cycles / ms.count : 0;
+	avg_free_cycles = fs.count ? total_free_cycles / fs.count : 0;
+#endif
 	
 	printf("Number of allocated blocks: %ld \n", num_alloc_blks);
 	printf("Number of free blocks: %ld \n", num_free_blks);
@@ -301,11 +2081,493 @@ void HEAP_CHECKER() {
 	printf("Padded total number of bytes allocated: %ld \n", Ptotal_alloc_bytes);
 	printf("Raw total number of bytes free: %ld \n", Rtotal_free_bytes);
 	printf("Aligned total number of bytes free: %ld \n", Atotal_free_bytes);
+	printf("Largest free block: %zu \n", hs.largest_free);
+	printf("Peak padded bytes allocated: %zu \n", hs.peak_block_bytes);
+	printf("External/internal fragmentation: %.3f/%.3f \n", hs.external_frag, hs.internal_frag);
+	printf("Bytes of free blocks purged: %zu \n", hs.purged_bytes);
 	printf("Total number of Malloc requests: %ld \n", total_malloc_reqs);
 	printf("Total number of Free requests: %ld \n", total_free_reqs);
 	printf("Total number of request failures: %ld \n", total_req_fails);
 	printf("Average clock cycles for a Malloc request: %ld \n", avg_malloc_cycles);
 	printf("Average clock cycles for a Free request: %ld \n", avg_free_cycles);
 	printf("Total clock cycles for all requests: %ld \n", total_cycles);	
+#ifdef LATENCY_STATS
+	printf("Malloc clock cycles p50/p99/p999/max: %llu/%llu/%llu/%llu \n", ms.p50, ms.p99, ms.p999, ms.max);
+	printf("Free clock cycles p50/p99/p999/max: %llu/%llu/%llu/%llu \n", fs.p50, fs.p99, fs.p999, fs.max);
+#endif
+	printf("Number of inconsistent boundary tags: %ld \n", tag_errors);
+	FitStats(fit_policy, &fs_fit);
+	printf("Fit policy: %d, searches: %ld, misses: %ld \n", fit_policy, fs_fit.searches, fs_fit.misses);
+	printf("Average free blocks probed per fit search: %ld \n", fs_fit.searches ? fs_fit.probes / fs_fit.searches : 0);
+	printf("Average bytes of slack per fit: %ld \n", (fs_fit.searches - fs_fit.misses) ? fs_fit.slack / (fs_fit.searches - fs_fit.misses) : 0);
+#ifdef HEAP_PROFILE
+	double prof_bytes = 0;
+	PROF_LOCK();
+	for (i = 0; i < prof_num_sites; i++)
+		prof_bytes += prof_sites[i].live_bytes;
+	printf("Sampled live bytes (estimated): %.0f in %d call sites, %ld samples dropped \n", prof_bytes, prof_num_sites, prof_dropped);
+	PROF_UNLOCK();
+#endif
+#ifdef CONCURRENT
+	printf("Number of contended arena locks: %ld \n", contended);
+	printf("Clock cycles spent waiting for arena locks: %ld \n", wait_cycles);
+#endif
+
+}
+
+#ifdef CONCURRENT
+/* Sums over all arenas the lock acquisitions that had to wait and the clock
+ * cycles spent waiting, for benchmarks to measure contention */
+void LockContention(long *contended, long *wait_cycles){
+
+	int i;
+
+	*contended = *wait_cycles = 0;
+	for (i = 0; (i < NUM_ARENAS) && (baseptr != 0); i++) {
+		pthread_mutex_lock(&arenas[i].lock);
+		*contended += arenas[i].lock_contended;
+		*wait_cycles += arenas[i].lock_wait_cycles;
+		pthread_mutex_unlock(&arenas[i].lock);
+	}
+}
+#endif
+
+/* Helper function for HEAP_CHECKER.
+ * Walks arena ar and counts blocks whose prev allocated bit disagrees with the
+ * block before them, and free blocks whose footer disagrees with the header. */
+static long check_tags(struct arena *ar){
+
+	long errors = 0;
+	size_t prev_alloc = PREV_ALLOC;
+	char *bp;
 
+	for (bp = ar->lo; GET_SIZE(HDRP(bp)) > 0; bp = NEXT_BLKP(bp)) {
+
+		if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc)
+			errors++;
+		if (!GET_ALLOC(HDRP(bp)) && (GET_SIZE(HDRP(bp)) != GET_SIZE(FTRP(bp))))
+			errors++;
+		prev_alloc = GET_ALLOC(HDRP(bp)) ? PREV_ALLOC : 0;
+	}
+	if (GET_PREV_ALLOC(HDRP(bp)) != prev_alloc)	//epilogue
+		errors++;
+	return errors;
 }	
+
+#ifdef LATENCY_STATS
+/* Helper function for Malloc and Free.
+ * Adds a call of op for a request of size bytes that took cycles cycles. */
+static void lat_record(int op, size_t size, unsigned long long cycles){
+
+	int c = (size > 1) ? 63 - __builtin_clzll(size) : 0;
+	int b = (cycles > 1) ? 63 - __builtin_clzll(cycles) : 0;
+
+	if (c >= LAT_CLASSES)
+		c = LAT_CLASSES - 1;
+	if (b >= LAT_BUCKETS)
+		b = LAT_BUCKETS - 1;
+
+	__atomic_fetch_add(&lat_hist[op][c][b], 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&lat_total[op], cycles, __ATOMIC_RELAXED);
+
+	unsigned long long m = __atomic_load_n(&lat_max[op][c], __ATOMIC_RELAXED);
+	while ((cycles > m) && !__atomic_compare_exchange_n(&lat_max[op][c], &m, cycles, 1,
+		__ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+/* Helper function for LatencyStats.
+ * Returns the upper bound of the bucket holding the permille-th call of hist. */
+static unsigned long long lat_percentile(unsigned long long *hist, unsigned long long count, int permille){
+
+	unsigned long long rank = (count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		seen += hist[b];
+		if (seen >= rank)
+			break;
+	}
+	return (2ULL << b) - 1;
+}
+
+/* Fills st with the latency of op (LAT_MALLOC or LAT_FREE) for requests
+ * in size class cls, or in all classes if cls is -1 */
+void LatencyStats(int op, int cls, struct lat_stats *st){
+
+	unsigned long long hist[LAT_BUCKETS] = { 0 };
+	int c, b;
+
+	memset(st, 0, sizeof(*st));
+	for (c = 0; c < LAT_CLASSES; c++) {
+		if ((cls >= 0) && (c != cls))
+			continue;
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			unsigned long long n = __atomic_load_n(&lat_hist[op][c][b], __ATOMIC_RELAXED);
+			hist[b] += n;
+			st->count += n;
+		}
+		if (lat_max[op][c] > st->max)
+			st->max = lat_max[op][c];
+	}
+	if (st->count == 0)
+		return;
+
+	st->p50 = lat_percentile(hist, st->count, 500);
+	st->p99 = lat_percentile(hist, st->count, 990);
+	st->p999 = lat_percentile(hist, st->count, 999);
+	if (st->p50 > st->max)
+		st->p50 = st->max;
+	if (st->p99 > st->max)
+		st->p99 = st->max;
+	if (st->p999 > st->max)
+		st->p999 = st->max;
+}
+
+/* Clears all latency histograms */
+void ResetLatencyStats(){
+
+	memset(lat_hist, 0, sizeof(lat_hist));
+	memset(lat_max, 0, sizeof(lat_max));
+	memset(lat_total, 0, sizeof(lat_total));
+}
+#endif
+
+#ifdef HEAP_PROFILE
+/* Sets the mean number of bytes allocated between two samples, 0 stops
+ * sampling. Live samples stay counted until their blocks are freed. The
+ * calling thread draws its next count at the new rate, other threads after
+ * their next sample. */
+void SetProfileRate(size_t rate) {
+
+	prof_rate = rate;
+	if ((rate != 0) && (prof_seed != 0))
+		prof_left = prof_interval(rate);
+}
+
+/* Helper function for Malloc.
+ * Called when the calling thread's count reaches the block at bp of size
+ * requested bytes, records its stack and draws the next count. Not inlined,
+ * so the first frame of the stack is its own. */
+__attribute__((noinline)) static void prof_sample(addrs_t bp, size_t size){
+
+	struct prof_trace t = { { 0 }, 0, 1 };
+	size_t rate = prof_rate;
+	unsigned int h = PROF_HASH(bp);
+	int i, slot = -1;
+
+	if (rate == 0)
+		return;
+	if (prof_seed == 0) {		//first count of the thread, not a sample yet
+		prof_seed = ((unsigned long long)now_ms() << 24) ^ (uintptr_t)&prof_seed;
+		prof_left += prof_interval(rate);
+		if (prof_left >= 0)
+			return;
+	}
+	prof_left = prof_interval(rate);
+	_Unwind_Backtrace(prof_frame, &t);
+
+	PROF_LOCK();
+	int site = prof_find_site(t.stack, t.depth);
+	if ((site < 0) || (prof_live >= PROF_SLOTS / 2)) {
+		prof_dropped++;
+		PROF_UNLOCK();
+		return;
+	}
+
+	/* take the first free slot, or the one of a block freed without Free */
+	for (i = 0; i < PROF_SLOTS; i++) {
+		struct prof_sample *s = &prof_table[(h + i) & (PROF_SLOTS - 1)];
+
+		if (s->addr == bp) {
+			prof_remove(s);
+			slot = i;
+			break;
+		}
+		if ((s->addr == PROF_GONE) && (slot < 0))
+			slot = i;
+		if (s->addr == NULL) {
+			if (slot < 0)
+				slot = i;
+			break;
+		}
+	}
+
+	struct prof_sample *s = &prof_table[(h + slot) & (PROF_SLOTS - 1)];
+	struct prof_site *ps = &prof_sites[site];
+	s->size = size;
+	s->weight = 1 / (1 - prof_exp_neg((double)size / rate));
+	s->site = site;
+	if (prof_homes[h] < 255)
+		__atomic_store_n(&prof_homes[h], prof_homes[h] + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&s->addr, bp, __ATOMIC_RELEASE);
+	if (slot > prof_max_probe)
+		__atomic_store_n(&prof_max_probe, slot, __ATOMIC_RELEASE);
+	__atomic_fetch_add(&prof_live, 1, __ATOMIC_RELAXED);
+
+	ps->live_samples++;
+	ps->alloc_samples++;
+	ps->live_sampled += size;
+	ps->alloc_sampled += size;
+	ps->live_bytes += s->weight * size;
+	ps->alloc_bytes += s->weight * size;
+	PROF_UNLOCK();
+}
+
+/* Helper function for prof_sample.
+ * Adds the return address of one frame to the prof_trace at arg. Unwinds
+ * with libgcc rather than backtrace, which may allocate on its first call. */
+static _Unwind_Reason_Code prof_frame(struct _Unwind_Context *ctx, void *arg){
+
+	struct prof_trace *t = (struct prof_trace *)arg;
+	uintptr_t ip = _Unwind_GetIP(ctx);
+
+	if (ip == 0)			//past the outermost frame
+		return _URC_END_OF_STACK;
+	if (t->skip > 0) {
+		t->skip--;
+		return _URC_NO_REASON;
+	}
+	if (t->depth == PROF_DEPTH)
+		return _URC_END_OF_STACK;
+	t->stack[t->depth++] = (void *)ip;
+	return _URC_NO_REASON;
+}
+
+/* Helper function for Free.
+ * Removes the sample of the block at addr, if it has one. Samples never
+ * move and their slots never become empty again, so the probe needs no
+ * lock until it finds addr. */
+static void prof_forget(addrs_t addr){
+
+	unsigned int h = PROF_HASH(addr);
+	int i, max = __atomic_load_n(&prof_max_probe, __ATOMIC_ACQUIRE);
+
+	if (__atomic_load_n(&prof_homes[h], __ATOMIC_ACQUIRE) == 0)	//stays in cache, the table doesn't
+		return;
+	for (i = 0; i <= max; i++) {
+		struct prof_sample *s = &prof_table[(h + i) & (PROF_SLOTS - 1)];
+		addrs_t a = __atomic_load_n(&s->addr, __ATOMIC_ACQUIRE);
+
+		if (a == NULL)
+			return;
+		if (a == addr) {
+			PROF_LOCK();
+			if (s->addr == addr)
+				prof_remove(s);
+			PROF_UNLOCK();
+			return;
+		}
+	}
+}
+
+/* Helper function for prof_sample and prof_forget.
+ * Takes sample s off its call site, the profile lock is held. */
+static void prof_remove(struct prof_sample *s){
+
+	struct prof_site *ps = &prof_sites[s->site];
+	unsigned int h = PROF_HASH(s->addr);
+
+	if (prof_homes[h] < 255)
+		__atomic_store_n(&prof_homes[h], prof_homes[h] - 1, __ATOMIC_RELAXED);
+	ps->live_samples--;
+	ps->live_sampled -= s->size;
+	ps->live_bytes -= s->weight * s->size;
+	if (ps->live_samples == 0)
+		ps->live_bytes = 0;		//no rounding left over
+	__atomic_store_n(&s->addr, PROF_GONE, __ATOMIC_RELEASE);
+	__atomic_fetch_sub(&prof_live, 1, __ATOMIC_RELAXED);
+}
+
+/* Helper function for prof_sample.
+ * Returns the call site of the stack, adding it if it's new, or -1 if
+ * there is no room for it. The profile lock is held. */
+static int prof_find_site(void **stack, int depth){
+
+	unsigned long long h = depth;
+	int i, k;
+
+	for (i = 0; i < depth; i++)
+		h = (h ^ (uintptr_t)stack[i]) * 0x100000001B3ULL;
+	for (k = h % (2 * PROF_SITES); prof_site_index[k] != 0; k = (k + 1) % (2 * PROF_SITES)) {
+		struct prof_site *ps = &prof_sites[prof_site_index[k] - 1];
+
+		if ((ps->depth == depth) && !memcmp(ps->stack, stack, depth * sizeof(void *)))
+			return prof_site_index[k] - 1;
+	}
+	if (prof_num_sites == PROF_SITES)
+		return -1;
+
+	struct prof_site *ps = &prof_sites[prof_num_sites];
+	memcpy(ps->stack, stack, depth * sizeof(void *));
+	ps->depth = depth;
+	prof_site_index[k] = ++prof_num_sites;
+	return prof_num_sites - 1;
+}
+
+/* Helper function for Init.
+ * Forgets all samples and call sites. Only the parts of the tables in use
+ * are cleared, so builds that never sample don't touch them. */
+static void prof_reset(){
+
+	if (prof_num_sites != 0) {
+		memset(prof_table, 0, sizeof(prof_table));
+		memset(prof_homes, 0, sizeof(prof_homes));
+		memset(prof_sites, 0, prof_num_sites * sizeof(struct prof_site));
+		memset(prof_site_index, 0, sizeof(prof_site_index));
+	}
+	prof_num_sites = 0;
+	prof_live = 0;
+	prof_max_probe = 0;
+	prof_dropped = 0;
+	prof_start = now_ms();
+}
+
+/* Helper function for prof_sample.
+ * Returns an exponentially distributed count of bytes with mean rate,
+ * from the calling thread's xorshift generator. */
+static long prof_interval(size_t rate){
+
+	prof_seed ^= prof_seed >> 12;
+	prof_seed ^= prof_seed << 25;
+	prof_seed ^= prof_seed >> 27;
+
+	double u = (((prof_seed * 0x2545F4914F6CDD1DULL) >> 11) + 1) / 9007199254740992.0;	//(0, 1]
+	return (long)(-prof_log(u) * rate) + 1;
+}
+
+/* Natural logarithm of x > 0, so the profiler doesn't need libm.
+ * Splits x into 2^e * m and sums the atanh series of m in [1, 2). */
+static double prof_log(double x){
+
+	union { double d; unsigned long long u; } v = { x };
+	int e = (int)((v.u >> 52) & 0x7ff) - 1023;
+
+	v.u = (v.u & ((1ULL << 52) - 1)) | (1023ULL << 52);
+	double t = (v.d - 1) / (v.d + 1), t2 = t * t;
+	return e * 0.6931471805599453 + 2 * t * (1 + t2 * (1.0 / 3 + t2 * (1.0 / 5 + t2 * (1.0 / 7 + t2 / 9))));
+}
+
+/* e^-x for x >= 0, so the profiler doesn't need libm.
+ * Splits x into n ln 2 + y and sums the Taylor series of e^-y. */
+static double prof_exp_neg(double x){
+
+	union { double d; unsigned long long u; } v;
+	double term = 1, sum = 1;
+	int i, n;
+
+	if (x > 700)
+		return 0;
+	n = (int)(x / 0.6931471805599453);
+	double y = x - n * 0.6931471805599453;
+	for (i = 1; i < 14; i++) {
+		term *= -y / i;
+		sum += term;
+	}
+	v.u = (unsigned long long)(1023 - n) << 52;		//2^-n
+	return sum * v.d;
+}
+
+/* Copies up to n call sites with the most live bytes into out, most first,
+ * and returns how many were copied */
+int ProfileSites(struct prof_site *out, int n){
+
+	double secs = (now_ms() - prof_start) / 1000.0;
+	int i, j, got = 0;
+
+	if (secs < 0.001)
+		secs = 0.001;
+	PROF_LOCK();
+	for (i = 0; i < prof_num_sites; i++) {
+		struct prof_site *ps = &prof_sites[i];
+
+		for (j = got; (j > 0) && (out[j - 1].live_bytes < ps->live_bytes); j--)
+			if (j < n)
+				out[j] = out[j - 1];
+		if (j >= n)
+			continue;
+		out[j] = *ps;
+		out[j].alloc_rate = ps->alloc_bytes / secs;
+		if (got < n)
+			got++;
+	}
+	PROF_UNLOCK();
+	return got;
+}
+
+/* Writes the profile to the file at path in the heap profile format of
+ * gperftools, which pprof reads and unsamples. Every call site gets a line
+ * of its live and allocated samples and bytes and its stack, followed by
+ * the mappings of the process for symbolizing. Formats into a buffer and
+ * writes with write, so it doesn't allocate. A stack too deep for the
+ * buffer loses its outermost frames. Returns 0, or -1 on error. */
+int DumpProfile(const char *path){
+
+	char line[64 + PROF_DEPTH * 20];
+	long live = 0, allocs = 0;
+	size_t live_bytes = 0, alloc_bytes = 0;
+	int i, j, fd, maps, len, n, err = 0;
+
+	if ((fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644)) < 0) {
+		printf("can't open profile %s \n", path);
+		return -1;
+	}
+
+	PROF_LOCK();
+	for (i = 0; i < prof_num_sites; i++) {
+		live += prof_sites[i].live_samples;
+		allocs += prof_sites[i].alloc_samples;
+		live_bytes += prof_sites[i].live_sampled;
+		alloc_bytes += prof_sites[i].alloc_sampled;
+	}
+	len = snprintf(line, sizeof(line), "heap profile: %ld: %zu [%ld: %zu] @ heap_v2/%zu\n",
+		live, live_bytes, allocs, alloc_bytes, prof_rate);
+	err |= prof_write(fd, line, len);
+	for (i = 0; (i < prof_num_sites) && (err == 0); i++) {
+		struct prof_site *ps = &prof_sites[i];
+
+		len = snprintf(line, sizeof(line), "%ld: %zu [%ld: %zu] @",
+			ps->live_samples, ps->live_sampled, ps->alloc_samples, ps->alloc_sampled);
+		if (len > (int)sizeof(line) - 1)	//truncated, keep room for the newline
+			len = sizeof(line) - 1;
+		for (j = 0; j < ps->depth; j++) {
+			n = snprintf(line + len, sizeof(line) - len, " %p", ps->stack[j]);
+			if (n >= (int)sizeof(line) - len - 1)	//the frame and the newline don't fit
+				break;
+			len += n;
+		}
+		line[len++] = '\n';
+		err |= prof_write(fd, line, len);
+	}
+	PROF_UNLOCK();
+
+	err |= prof_write(fd, "\nMAPPED_LIBRARIES:\n", 19);
+	if ((maps = open("/proc/self/maps", O_RDONLY)) >= 0) {
+		while ((err == 0) && ((len = read(maps, line, sizeof(line))) > 0))
+			err |= prof_write(fd, line, len);
+		close(maps);
+	}
+	if ((close(fd) != 0) || (err != 0)) {
+		printf("can't write profile %s \n", path);
+		return -1;
+	}
+	return 0;
+}
+
+/* Helper function for DumpProfile.
+ * Writes all len bytes of buf to fd, going on after a short write.
+ * Returns 0, or -1 on error. */
+static int prof_write(int fd, const char *buf, size_t len){
+
+	while (len > 0) {
+		ssize_t n = write(fd, buf, len);
+
+		if (n <= 0)
+			return -1;
+		buf += n;
+		len -= n;
+	}
+	return 0;
+}
+#endif
@@ -3,36 +3,192 @@
 #include <string.h>
 #include <stdlib.h>
 #include <stddef.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <time.h>
+#ifdef BACKGROUND_COMPACT
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/* Headers, footers and hole links are one word. -DWIDE_HEADERS makes
+ * words 8 bytes, so blocks and M2 can be larger than 4 GB. */
+#ifdef WIDE_HEADERS
+typedef unsigned long long word_t;
+#else
+typedef unsigned int word_t;
+#endif
+#define WSIZE ((int)sizeof(word_t))
+#define MIN_BLOCK (4 * WSIZE)		//header, two hole links and footer
+
+/* Block size for a request of size bytes: payload, header and footer
+ * rounded up to a multiple of 8, at least MIN_BLOCK */
+#define ASIZE(size) (((size) + 2 * WSIZE <= MIN_BLOCK) ? MIN_BLOCK : 8 * (((size) + 2 * WSIZE + 7) / 8))
 
 /* Pack a size and allocated bit into a word */
 #define PACK(size, alloc) ((size) | (alloc))
 
 /* Read and write a word at address p */
-#define GET(p) (*(unsigned int *)(p))
-#define PUT(p, val) (*(unsigned int *)(p) = (val))
+#define GET(p) (*(word_t *)(p))
+#define PUT(p, val) (*(word_t *)(p) = (val))
 
 /* Read the size and allocated fields from address p */
 #define GET_SIZE(p) (GET(p) & ~0x7) 
 #define GET_ALLOC(p) (GET(p) & 0x1)
 
 /* Compute address of header and footer */
-#define HDRP(p) ((char *)(p) - 4)
-#define FTRP(p) ((char *)(p) + GET_SIZE(HDRP(p))-8)
+#define HDRP(p) ((char *)(p) - WSIZE)
+#define FTRP(p) ((char *)(p) + GET_SIZE(HDRP(p)) - 2 * WSIZE)
 
 /* Compute address of next and previous block */
 #define NEXT_BLKP(p) ((char *)(p) + GET_SIZE(HDRP(p)))
-#define PREV_BLKP(p) ((char *)(p) - GET_SIZE(HDRP(p) - 4))
+#define PREV_BLKP(p) ((char *)(p) - GET_SIZE(HDRP(p) - WSIZE))
+
+/* RT reserves one entry per MIN_BLOCK bytes of M2, the most blocks M2 can hold,
+ * and commits RT_CHUNK entries at a time as handles are handed out */
+#define RT_CHUNK 4096
+
+/* Unused RT entries form a free list. Each holds the index + 1 of the next
+ * unused entry (0 ends the list), shifted and tagged with the low bit so it
+ * never looks like a block address, which is always 8 byte aligned. */
+#define FREE_HANDLE_TAG 0x1
+#define IS_FREE_HANDLE(e) (((unsigned long long)(e)) & FREE_HANDLE_TAG)
+#define PACK_FREE_HANDLE(next) ((addrs_t)((((unsigned long long)(next)) << 1) | FREE_HANDLE_TAG))
+#define NEXT_FREE_HANDLE(e) ((long)(((unsigned long long)(e)) >> 1))
+
+/* True if h is an RT entry that refers to an allocated block */
+#define IS_LIVE_HANDLE(h) (((h) >= RT) && ((h) < RT + rt_used) && (*(h) != NULL) && !IS_FREE_HANDLE(*(h)))
+
+/* Allocated blocks keep the index of the RT entry that owns them in the
+ * footer in place of the size, so compaction can fix the entries of the
+ * blocks it moves without searching RT */
+#define PACK_OWNER(h) ((((word_t)((h) - RT)) << 3) | 1)
+#define GET_OWNER(bp) (RT + (GET(FTRP(bp)) >> 3))
+
+/* Compaction publishes the new address of a moved block with a release
+ * store, so a thread that pinned another block never sees a torn entry */
+#define PUBLISH(h, bp) __atomic_store_n((h), (bp), __ATOMIC_RELEASE)
+
+/* True if the RT entry that owns allocated block bp is pinned by VPin */
+#define IS_PINNED(bp) ((num_pinned > 0) && (rt_pins[GET_OWNER(bp) - RT] != 0))
+
+/* Alignment of the payload of allocated block bp, 0 unless VMallocAligned
+ * asked for more than 8 bytes. RT entries keep its log2. */
+#define BLK_ALIGN(bp) (((num_aligned > 0) && rt_align[GET_OWNER(bp) - RT]) ? (1UL << rt_align[GET_OWNER(bp) - RT]) : 0)
+
+#ifdef HUGE_PAGES
+#ifndef HUGE_PAGE_SIZE
+#define HUGE_PAGE_SIZE (2UL << 20)
+#endif
+#endif
+
+/* Purging: the free chunk grows down as VFree and compaction free blocks.
+ * Once it has grown by purge_threshold bytes that stayed free for
+ * purge_decay ms, the whole pages of that part are handed back to the OS.
+ * The chunk above purged_from is clean already. The clock is read every
+ * PURGE_INTERVAL calls that free, see VSetPurge. */
+#ifndef PURGE_THRESHOLD
+#define PURGE_THRESHOLD (64 * 1024)
+#endif
+#ifndef PURGE_DECAY
+#define PURGE_DECAY 1000
+#endif
+#ifndef PURGE_ADVICE
+#define PURGE_ADVICE MADV_DONTNEED
+#endif
+#define PURGE_INTERVAL 64
+#ifndef CLOCK_MONOTONIC_COARSE
+#define CLOCK_MONOTONIC_COARSE CLOCK_MONOTONIC
+#endif
+
+/* Locality mode, see VSetLocality. Accesses are counted per RT entry, and
+ * once the live blocks have been touched rt_live times since the last
+ * reorder, the next compaction moves the blocks touched more than average
+ * in front of the others. Counts are halved after each reorder, so the
+ * order follows recent accesses. */
+#define TOUCH(h) { if (locality) { if (++rt_heat[(h) - RT] == 0) rt_heat[(h) - RT]--; heat_touches++; } }
+#define IS_HOT(bp, total) ((unsigned long long)rt_heat[GET_OWNER(bp) - RT] * rt_live > (total))
+
+/* Compaction policies, see VSetCompaction */
+#define COMPACT_EAGER 0		//compact on every VFree, M2 never has holes
+#define COMPACT_DEFERRED 1	//leave holes, compact fully past the fragmentation threshold
+#define COMPACT_INCREMENTAL 2	//leave holes, compact a bounded slice on every call
+#define COMPACT_BACKGROUND 3	//leave holes, the compactor thread closes them, see VStartCompactor
+
+/* Holes left by VFree keep links to their neighbours on the hole list in the
+ * first two payload words, as offsets from heap_lo */
+#define PRED_HOLE(bp) ((char *)(bp))
+#define SUCC_HOLE(bp) ((char *)(bp) + WSIZE)
+#define GET_HOLE(p) (GET(p) ? heap_lo + GET(p) : NULL)
+#define PUT_HOLE(p, bp) PUT(p, (bp) ? (word_t)((char *)(bp) - heap_lo) : 0)
+
+/* Bytes of allocated blocks, the used part of M2 less its holes */
+#define BLOCK_BYTES() ((size_t)(baseptr - (heap_lo + 4 * WSIZE)) - hole_bytes)
+
+/* Fragmentation summary returned by VHeapStats. The free blocks are the holes
+ * and the free chunk, free_hist counts them in size classes like M1's free
+ * lists, class c holding [2^(c+4), 2^(c+5)) bytes and the last class
+ * everything larger. Requested sizes aren't kept, so alloc_bytes counts the
+ * payload the allocated blocks can hold. */
+#define NUM_CLASSES 20
 
-/* Helper function prototype declarations */
-static void place(void *bp, size_t asize);
-static void *compact(void *bpM, addrs_t *bp);
+struct heap_stats {
+	long alloc_blks;
+	long free_blks;
+	size_t alloc_bytes;		//payload bytes of allocated blocks
+	size_t block_bytes;		//bytes of allocated blocks, header and owner footer included
+	size_t peak_block_bytes;	//highest block_bytes
+	size_t free_bytes;		//bytes of the holes and the free chunk
+	size_t largest_free;		//bytes of the largest of them
+	long free_hist[NUM_CLASSES];	//free blocks of each size class
+	double external_frag;		//1 - largest_free / free_bytes
+	double internal_frag;		//1 - alloc_bytes / block_bytes
+	size_t purged_bytes;		//bytes of the free chunk handed back to the OS so far
+};
 
-/* Default size for VInit and Redirection Table */
-#define DEFAULT_MEM_SIZE (1<<20)
-#define MAX_NUM_BLOCKS (DEFAULT_MEM_SIZE/16)
+/* Entries RT is reserved for, enough for M2 full of minimum size blocks */
+#define RT_CAP(size) ((((size) / MIN_BLOCK + RT_CHUNK - 1) / RT_CHUNK) * RT_CHUNK)
+
+/* Heap files, see VOpen. The file holds this header, RT, the alignment of
+ * each RT entry and M2, each starting on a page. The header keeps the M2
+ * globals as of the last VSync, pointers as offsets from heap_lo. Hole
+ * links and owner footers are offsets and indices already, only live RT
+ * entries are addresses and VOpen rebases them if M2 maps elsewhere. */
+#define HEAP_FILE_MAGIC 0x5041333248454150ULL	//"PA32HEAP"
+#define HEAP_FILE_VERSION 1
+
+struct heap_file {
+	unsigned long long magic;
+	int version;
+	int word_size;
+	int clean;			//1 if M2 hasn't changed since the last VSync
+	size_t size;			//bytes of M2
+	long rt_cap;
+	char *base;			//heap_lo at the last VSync
+	size_t baseptr;
+	size_t holes;			//0 if there are none
+	long rt_free;
+	long rt_used;
+	long rt_committed;
+	long rt_live;
+	long rt_root;
+	long num_aligned;
+	long num_holes;
+	size_t hole_bytes;
+	size_t largest_hole;
+	int largest_stale;
+	size_t peak_block_bytes;
+	long hole_hist[NUM_CLASSES];
+};
+
+/* Flushes the cleared clean flag before the first change after a VSync */
+#define DIRTY_FILE() { if ((hfile != NULL) && hfile->clean) mark_file_dirty(); }
 
 /* Calculates difference between 2 addresses */
-#define ADDR_DIFF(p1, p2) ((int)((unsigned long long)(p1) - (unsigned long long)(p2)))
+#define ADDR_DIFF(p1, p2) ((long long)((unsigned long long)(p1) - (unsigned long long)(p2)))
 
 /* HEAP CHECKER global variables and macros */
 long num_alloc_blks = 0;
@@ -62,15 +218,137 @@ unsigned long long start, finish;
 long total_malloc_cycles = 0;
 long total_free_cycles = 0;
 
-/* helper function prototypes */
-static void place(void *bp, size_t asize);
-static void *compact(void *bp);
+#ifdef LATENCY_STATS
+/* Latency histograms, enabled with -DLATENCY_STATS. VMalloc, VFree and each
+ * compaction are timed with RDTSC. Bucket b of a histogram counts calls that
+ * took [2^b, 2^(b+1)) cycles, and each operation keeps one histogram per size
+ * class, class c holding requests of [2^c, 2^(c+1)) bytes. For compaction the
+ * size is the number of bytes moved. */
+#define LAT_BUCKETS 40
+#define LAT_CLASSES 32
+#define LAT_MALLOC 0
+#define LAT_FREE 1
+#define LAT_COMPACT 2
+#define LAT_OPS 3
+
+/* Summary returned by VLatencyStats. Percentiles are the upper bound of the
+ * bucket they fall in, capped at max. */
+struct lat_stats {
+	unsigned long long count;
+	unsigned long long p50;
+	unsigned long long p99;
+	unsigned long long p999;
+	unsigned long long max;
+};
+
+static unsigned long long lat_hist[LAT_OPS][LAT_CLASSES][LAT_BUCKETS];
+static unsigned long long lat_max[LAT_OPS][LAT_CLASSES];
+static unsigned long long lat_total[LAT_OPS];
+
+static void lat_record(int op, size_t size, unsigned long long cycles);
+
+#define LAT_BEGIN(t) unsigned long long t##_begin, t##_end; RDTSC(t##_begin)
+#define LAT_END(t, op, size) { RDTSC(t##_end); lat_record(op, size, t##_end - t##_begin); }
+#else
+#define LAT_BEGIN(t)
+#define LAT_END(t, op, size)
+#endif
 
 typedef char *addrs_t;
 typedef void *any_t;
 
+/* helper function prototypes */
+static void place(void *bp, size_t asize, addrs_t *h);
+static void compact(void *bpM);
+static void release(addrs_t addrM);
+static addrs_t *vmalloc_request(size_t size);
+static void vfree_request(addrs_t *addr);
+static addrs_t *vrealloc_request(addrs_t *addr, size_t size);
+static addrs_t *get_handle();
+#ifdef HUGE_PAGES
+static addrs_t map_heap(size_t size);
+#endif
+static void put_handle(addrs_t *h);
+static void leave_hole(addrs_t bp);
+static void insert_hole(addrs_t bp);
+static void remove_hole(addrs_t bp);
+static addrs_t find_fit(size_t asize);
+static addrs_t align_payload(addrs_t bp, size_t align);
+static addrs_t find_aligned_fit(size_t asize, size_t align);
+static size_t compact_slice(size_t budget);
+static inline int size_class(size_t size);
+static void reorder_hot();
+static size_t partition_run(addrs_t run, addrs_t end, size_t hot_bytes, unsigned long long total);
+static size_t purge_tail(int all);
+static long long now_ms();
+static void lay_out_heap(addrs_t m, size_t size);
+static int reserve_rt(size_t size, addrs_t *file_rt, unsigned char *file_align);
+static void unmap_rt();
+static void reset_heap_state();
+static size_t file_layout(size_t size, long cap, size_t *rt_off, size_t *align_off, size_t *m2_off);
+static int sync_heap_file();
+static void mark_file_dirty();
+
 addrs_t baseptr = 0;
-addrs_t RT[MAX_NUM_BLOCKS];  //redirection table
+addrs_t *RT = NULL;  //redirection table
+static long rt_free = -1;	//first entry of the unused entry list, -1 if empty
+static long rt_used = 0;	//entries at and above this index were never handed out
+static long rt_committed = 0;	//entries backed by memory
+static long rt_cap = 0;		//entries reserved
+
+static char *heap_lo = 0;		//start of M2, base for hole list offsets
+static addrs_t holes = NULL;		//hole list, sorted by address
+static size_t hole_bytes = 0;		//total size of all holes
+static long num_holes = 0;
+static long hole_hist[NUM_CLASSES];	//holes of each size class
+static size_t largest_hole = 0;		//size of the largest hole, unless largest_stale
+static int largest_stale = 0;		//a hole of the largest size left the hole list
+static long rt_live = 0;		//RT entries that own a block
+static size_t peak_block_bytes = 0;
+static int compact_mode = COMPACT_EAGER;
+static int compact_threshold = 25;	//percent of the used part of M2 that may be holes
+static size_t compact_budget = 4096;	//bytes moved per incremental slice
+static size_t purge_threshold = PURGE_THRESHOLD;
+static long purge_decay = PURGE_DECAY;
+static size_t purge_page = 0;		//purged ranges are whole pages of this size
+static addrs_t purged_from = NULL;	//the free chunk is clean from here on
+static long long tail_dirty_since = 0;	//ms when the free chunk was first seen below purged_from
+static long purge_ticks = 0;		//calls that freed, paces the purge checks
+static size_t purged_bytes = 0;
+static unsigned int *rt_pins = NULL;	//pin count of each RT entry, committed along with RT
+static long num_pinned = 0;		//RT entries with a nonzero pin count
+static unsigned char *rt_align = NULL;	//log2 of the payload alignment of each RT entry's block, 0 if 8
+static long num_aligned = 0;		//RT entries with a nonzero alignment
+static unsigned int *rt_heat = NULL;	//access count of each RT entry, committed along with RT
+static int locality = 0;		//count accesses and reorder hot blocks
+static long heat_touches = 0;		//accesses counted since the last reorder
+static long rt_root = -1;		//RT entry VRoot returns, -1 if none
+static struct heap_file *hfile = NULL;	//start of the heap file mapping, NULL without VOpen
+static size_t hfile_len = 0;
+
+#ifdef BACKGROUND_COMPACT
+/* With -DBACKGROUND_COMPACT every public function holds m2_lock, which is
+ * recursive as they call each other, and the compactor thread takes it for
+ * one slice at a time. Between calls other threads may use *handle only
+ * while the block is pinned. */
+static pthread_mutex_t m2_lock;
+static pthread_once_t m2_lock_once = PTHREAD_ONCE_INIT;
+static pthread_cond_t compactor_cond = PTHREAD_COND_INITIALIZER;
+static pthread_t compactor;
+static int compactor_running = 0;
+static int compactor_prev_mode;		//mode VStopCompactor goes back to
+
+static void init_m2_lock();
+
+#define LOCK_HEAP() { pthread_once(&m2_lock_once, init_m2_lock); pthread_mutex_lock(&m2_lock); }
+#define UNLOCK_HEAP() pthread_mutex_unlock(&m2_lock)
+#define WAKE_COMPACTOR() pthread_cond_signal(&compactor_cond)
+#else
+#define LOCK_HEAP()
+#define UNLOCK_HEAP()
+#define WAKE_COMPACTOR() do { } while (0)
+#endif
+
 
 /* Initialize M2 region in memory with size bytes */
 void VInit(size_t size) {
@@ -81,26 +359,433 @@ void VInit(size_t size) {
 		return;
 	}
 
+	LOCK_HEAP();
+	unmap_rt();
+#ifdef HUGE_PAGES
+	baseptr = map_heap(size);
+#else
 	baseptr = (addrs_t)malloc(size);
-	unsigned long long shift = ((unsigned long long)(baseptr) %8);
-	baseptr = (char *)(baseptr) + shift;				//aligned start address of M1
+#endif
+	if (baseptr == NULL) {
+		printf("can't allocate M2 of %zu bytes \n", size);
+		UNLOCK_HEAP();
+		return;
+	}
+	unsigned long long shift = (8 - ((unsigned long long)(baseptr) % 8)) % 8;
+	size = (size - shift) & ~0x7;
+	lay_out_heap((char *)(baseptr) + shift, size);		//aligned start address of M2
+	reserve_rt(size, NULL, NULL);
+	reset_heap_state();
+	UNLOCK_HEAP();
+
+}
+
+/* Helper function for VInit and VOpen.
+ * Lays out the prologue, the free chunk and the epilogue in the size
+ * bytes at m, which is 8 byte aligned. */
+static void lay_out_heap(addrs_t m, size_t size) {
+
+	baseptr = heap_lo = m;
+
+	PUT(baseptr, 0);							//alignment padding
+	PUT(baseptr + WSIZE, PACK(2 * WSIZE, 1));				//prologue header
+	PUT(baseptr + 2 * WSIZE, PACK(2 * WSIZE, 1));				//prologue footer
+	PUT(baseptr + 3 * WSIZE, PACK(size - 4 * WSIZE, 0));			//header for initial free block chunk
+	PUT(baseptr + size - 2 * WSIZE, PACK(size - 4 * WSIZE, 0));		//footer for intitial free block chunk
+	PUT(baseptr + size - WSIZE, PACK(0, 1));				//epilogue
+
+	baseptr += 4 * WSIZE;
+}
+
+/* Helper function for VInit and VOpen.
+ * Reserves RT and its pin counts, alignments and access counts for an M2 of
+ * size bytes. Pages are committed and touched only when handles need them.
+ * RT and the alignments of a heap file are in the file mapping already.
+ * Returns 0, or -1 if the address space can't be reserved. */
+static int reserve_rt(size_t size, addrs_t *file_rt, unsigned char *file_align) {
+
+	rt_cap = RT_CAP(size);
+	RT = (file_rt != NULL) ? file_rt : (addrs_t *)mmap(NULL, rt_cap * sizeof(addrs_t), PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	rt_pins = (unsigned int *)mmap(NULL, rt_cap * sizeof(unsigned int), PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	rt_align = (file_align != NULL) ? file_align : (unsigned char *)mmap(NULL, rt_cap * sizeof(unsigned char), PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	rt_heat = (unsigned int *)mmap(NULL, rt_cap * sizeof(unsigned int), PROT_NONE,
+				MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+	if ((RT == MAP_FAILED) || (rt_pins == MAP_FAILED) || (rt_align == MAP_FAILED) || (rt_heat == MAP_FAILED)) {
+		printf("can't reserve address space for RT \n");
+		if ((RT != MAP_FAILED) && (file_rt == NULL))
+			munmap(RT, rt_cap * sizeof(addrs_t));
+		if (rt_pins != MAP_FAILED)
+			munmap(rt_pins, rt_cap * sizeof(unsigned int));
+		if ((rt_align != MAP_FAILED) && (file_align == NULL))
+			munmap(rt_align, rt_cap * sizeof(unsigned char));
+		if (rt_heat != MAP_FAILED)
+			munmap(rt_heat, rt_cap * sizeof(unsigned int));
+		RT = NULL;
+		rt_pins = NULL;
+		rt_align = NULL;
+		rt_heat = NULL;
+		rt_cap = 0;
+		return -1;
+	}
+	return 0;
+}
 
-	PUT(baseptr, 0);						//alignment padding
-	PUT(baseptr + 4, PACK(8, 1));					//prologue header
-	PUT(baseptr + 8, PACK(8, 1));					//prologue footer
-	PUT(baseptr + 12, PACK(size - 16 - shift, 0));			//header for initial free block chunk
-	PUT(baseptr + size - 8 - shift, PACK(size - 16 - shift, 0));	//footer for intitial free block chunk
-	PUT((baseptr + size - 8 - shift), PACK(0, 1));			//epilogue
+/* Helper function for VInit and VOpen.
+ * Unmaps RT and the heap file of an earlier VInit or VOpen. */
+static void unmap_rt() {
 
-	baseptr += 16;
+	if (RT != NULL) {
+		if (hfile == NULL) {
+			munmap(RT, rt_cap * sizeof(addrs_t));
+			munmap(rt_align, rt_cap * sizeof(unsigned char));
+		}
+		munmap(rt_pins, rt_cap * sizeof(unsigned int));
+		munmap(rt_heat, rt_cap * sizeof(unsigned int));
+	}
+	if (hfile != NULL)
+		munmap(hfile, hfile_len);
+	RT = NULL;
+	rt_pins = NULL;
+	rt_align = NULL;
+	rt_heat = NULL;
+	rt_cap = 0;
+	hfile = NULL;
+	hfile_len = 0;
+}
 
-	memset(RT, NULL, MAX_NUM_BLOCKS * sizeof(void *));
+/* Helper function for VInit and VOpen.
+ * Resets the globals of M2 for an empty heap. */
+static void reset_heap_state() {
 
+	rt_committed = 0;
+	rt_free = -1;
+	rt_used = 0;
+	rt_root = -1;
+	num_pinned = 0;
+	num_aligned = 0;
+	heat_touches = 0;
+	holes = NULL;
+	hole_bytes = 0;
+	num_holes = 0;
+	memset(hole_hist, 0, sizeof(hole_hist));
+	largest_hole = 0;
+	largest_stale = 0;
+	rt_live = 0;
+	peak_block_bytes = 0;
+#ifdef HUGE_PAGES
+	purge_page = HUGE_PAGE_SIZE;
+#else
+	purge_page = sysconf(_SC_PAGESIZE);
+#endif
+	purged_from = baseptr;
+	tail_dirty_since = 0;
+	purge_ticks = 0;
+	purged_bytes = 0;
 }
 
+/* Initializes M2 in the file at path, creating it with an M2 of size bytes
+ * if it doesn't hold a heap. A heap file last synced with VSync is mapped
+ * back as it was, with its own size: every block and RT entry survives
+ * without copying, and RT indices stay the same, see VHandleIndex. Files
+ * changed after their last VSync are started over, their blocks may be
+ * half moved. Returns 1 if the heap was reopened, 0 if it was created and
+ * -1 on failure. */
+int VOpen(const char *path, size_t size) {
+
+	struct heap_file hdr;
+	struct stat st;
+	size_t rt_off, align_off, m2_off, len;
+	int fd, reopen = 0;
+	char *m;
+
+	LOCK_HEAP();
+	if ((fd = open(path, O_RDWR | O_CREAT, 0600)) < 0) {
+		printf("can't open heap file %s \n", path);
+		UNLOCK_HEAP();
+		return -1;
+	}
+
+	if ((fstat(fd, &st) == 0) && (st.st_size >= (off_t)sizeof(hdr)) &&
+		(pread(fd, &hdr, sizeof(hdr), 0) == sizeof(hdr)) && (hdr.magic == HEAP_FILE_MAGIC) &&
+		(hdr.version == HEAP_FILE_VERSION) && (hdr.word_size == WSIZE)) {
+
+		len = file_layout(hdr.size, hdr.rt_cap, &rt_off, &align_off, &m2_off);
+		if (hdr.clean && ((size_t)st.st_size == len)) {
+			reopen = 1;
+			size = hdr.size;
+		}
+		else
+			printf("heap file %s wasn't synced, starting over \n", path);
+	}
+
+	size &= ~0x7;
+	if (!reopen) {
+		if (size < 4 * MIN_BLOCK) {
+			printf("attempt to initialize M2 of %zu bytes \n", size);
+			close(fd);
+			UNLOCK_HEAP();
+			return -1;
+		}
+		len = file_layout(size, RT_CAP(size), &rt_off, &align_off, &m2_off);
+		if ((ftruncate(fd, 0) != 0) || (ftruncate(fd, len) != 0)) {
+			printf("can't size heap file %s \n", path);
+			close(fd);
+			UNLOCK_HEAP();
+			return -1;
+		}
+	}
+
+	/* at the old address if it is free, so RT needs no rebasing */
+	unmap_rt();
+	m = (char *)mmap(reopen ? hdr.base - m2_off : NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (m == MAP_FAILED) {
+		printf("can't map heap file %s \n", path);
+		baseptr = 0;
+		UNLOCK_HEAP();
+		return -1;
+	}
+	hfile = (struct heap_file *)m;
+	hfile_len = len;
+	if (reserve_rt(size, (addrs_t *)(m + rt_off), (unsigned char *)(m + align_off)) != 0) {
+		unmap_rt();
+		baseptr = 0;
+		UNLOCK_HEAP();
+		return -1;
+	}
+
+	if (!reopen) {
+		lay_out_heap(m + m2_off, size);
+		reset_heap_state();
+		memset(hfile, 0, sizeof(*hfile));
+		hfile->magic = HEAP_FILE_MAGIC;
+		hfile->version = HEAP_FILE_VERSION;
+		hfile->word_size = WSIZE;
+		hfile->size = size;
+		hfile->rt_cap = rt_cap;
+		sync_heap_file();
+		UNLOCK_HEAP();
+		return 0;
+	}
+
+	heap_lo = m + m2_off;
+	reset_heap_state();
+	baseptr = heap_lo + hdr.baseptr;
+	holes = hdr.holes ? heap_lo + hdr.holes : NULL;
+	rt_free = hdr.rt_free;
+	rt_used = hdr.rt_used;
+	rt_committed = hdr.rt_committed;
+	rt_live = hdr.rt_live;
+	rt_root = hdr.rt_root;
+	num_aligned = hdr.num_aligned;
+	num_holes = hdr.num_holes;
+	hole_bytes = hdr.hole_bytes;
+	largest_hole = hdr.largest_hole;
+	largest_stale = hdr.largest_stale;
+	peak_block_bytes = hdr.peak_block_bytes;
+	memcpy(hole_hist, hdr.hole_hist, sizeof(hole_hist));
+	purged_from = baseptr;
+	if (rt_committed > 0) {
+		mprotect(rt_pins, rt_committed * sizeof(unsigned int), PROT_READ | PROT_WRITE);
+		mprotect(rt_heat, rt_committed * sizeof(unsigned int), PROT_READ | PROT_WRITE);
+	}
+
+	if (heap_lo != hdr.base) {	//mapped elsewhere, rebase the live entries
+		long long delta = ADDR_DIFF(heap_lo, hdr.base);
+		long i;
+
+		mark_file_dirty();
+		for (i = 0; i < rt_used; i++)
+			if ((RT[i] != NULL) && !IS_FREE_HANDLE(RT[i]))
+				RT[i] += delta;
+		sync_heap_file();
+	}
+	UNLOCK_HEAP();
+	return 1;
+}
+
+/* Checkpoints a heap opened with VOpen: writes the M2 globals to the
+ * file's header and flushes every changed page to the file. VOpen brings
+ * the heap back as of the last VSync. Returns 0, or -1 if M2 isn't backed
+ * by a file or can't be flushed. */
+int VSync() {
+
+	int err;
+
+	LOCK_HEAP();
+	if (hfile == NULL) {
+		printf("M2 is not backed by a file \n");
+		UNLOCK_HEAP();
+		return -1;
+	}
+	err = sync_heap_file();
+	UNLOCK_HEAP();
+	return err;
+}
+
+/* Helper function for VOpen.
+ * Returns the length of a heap file for an M2 of size bytes and an RT of
+ * cap entries, and where RT, the alignments and M2 start in it. */
+static size_t file_layout(size_t size, long cap, size_t *rt_off, size_t *align_off, size_t *m2_off) {
+
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	*rt_off = (sizeof(struct heap_file) + page - 1) & ~(page - 1);
+	*align_off = *rt_off + ((cap * sizeof(addrs_t) + page - 1) & ~(page - 1));
+	*m2_off = *align_off + ((cap * sizeof(unsigned char) + page - 1) & ~(page - 1));
+	return *m2_off + ((size + page - 1) & ~(page - 1));
+}
+
+/* Helper function for VSync and VOpen.
+ * Saves the M2 globals in the header and flushes the file with the header
+ * marked unclean, then marks it clean and flushes the header again. A
+ * crash before the second flush leaves a file VOpen won't trust.
+ * Returns 0, or -1 if the file can't be flushed. */
+static int sync_heap_file() {
+
+	hfile->clean = 0;
+	hfile->base = heap_lo;
+	hfile->baseptr = baseptr - heap_lo;
+	hfile->holes = (holes != NULL) ? (size_t)(holes - heap_lo) : 0;
+	hfile->rt_free = rt_free;
+	hfile->rt_used = rt_used;
+	hfile->rt_committed = rt_committed;
+	hfile->rt_live = rt_live;
+	hfile->rt_root = rt_root;
+	hfile->num_aligned = num_aligned;
+	hfile->num_holes = num_holes;
+	hfile->hole_bytes = hole_bytes;
+	hfile->largest_hole = largest_hole;
+	hfile->largest_stale = largest_stale;
+	hfile->peak_block_bytes = peak_block_bytes;
+	memcpy(hfile->hole_hist, hole_hist, sizeof(hole_hist));
+
+	if (msync(hfile, hfile_len, MS_SYNC) != 0)
+		return -1;
+	hfile->clean = 1;
+	return msync(hfile, sizeof(*hfile), MS_SYNC);
+}
+
+/* Helper function for DIRTY_FILE.
+ * Marks the heap file unclean on disk before M2 changes. */
+static void mark_file_dirty() {
+
+	hfile->clean = 0;
+	msync(hfile, sizeof(*hfile), MS_SYNC);
+}
+
+/* Makes the block of RT entry addr the root of M2, NULL for none. A heap
+ * reopened with VOpen finds its records through the root. */
+void VSetRoot(addrs_t *addr) {
+
+	LOCK_HEAP();
+	if ((addr != NULL) && ((baseptr == 0) || !IS_LIVE_HANDLE(addr))) {
+		printf("%s", "invalid address \n");
+		UNLOCK_HEAP();
+		return;
+	}
+	DIRTY_FILE();
+	rt_root = (addr != NULL) ? addr - RT : -1;
+	UNLOCK_HEAP();
+}
+
+/* Returns the RT entry of the root of M2, or NULL if there is none */
+addrs_t *VRoot() {
+
+	addrs_t *addr = NULL;
+
+	LOCK_HEAP();
+	if ((baseptr != 0) && (rt_root >= 0))
+		addr = RT + rt_root;
+	UNLOCK_HEAP();
+	return addr;
+}
+
+/* Returns the index of RT entry addr. Indices stay the same when VOpen
+ * maps a heap file back, so records can refer to each other by them. */
+long VHandleIndex(addrs_t *addr) {
+	return addr - RT;
+}
+
+/* Returns the RT entry with index i, or NULL if it isn't live */
+addrs_t *VHandleAt(long i) {
+
+	addrs_t *addr = NULL;
+
+	LOCK_HEAP();
+	if ((baseptr != 0) && (i >= 0) && IS_LIVE_HANDLE(RT + i))
+		addr = RT + i;
+	UNLOCK_HEAP();
+	return addr;
+}
+
+#ifdef HUGE_PAGES
+/* Helper function for VInit.
+ * Maps size bytes for M2 from explicit huge pages if the pool has enough,
+ * and otherwise from normal pages with transparent huge pages requested,
+ * which the kernel may ignore. The M2 of an earlier VInit is unmapped.
+ * Returns NULL if nothing can be mapped. */
+static addrs_t map_heap(size_t size) {
+
+	static char *m2_map = NULL;
+	static size_t m2_len = 0;
+	size_t len = (size + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+	char *m = MAP_FAILED;
+
+	if (m2_map != NULL)
+		munmap(m2_map, m2_len);
+	m2_map = NULL;
+
+#ifdef MAP_HUGETLB
+	m = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+#endif
+	if (m == MAP_FAILED) {
+		m = (char *)mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+		if (m == MAP_FAILED)
+			return NULL;
+#ifdef MADV_HUGEPAGE
+		madvise(m, len, MADV_HUGEPAGE);
+#endif
+	}
+	m2_map = m;
+	m2_len = len;
+	return m;
+}
+#endif
+
 /* Allocate size bytes in M2 and return pointer to the start address of malloced region */
 addrs_t *VMalloc(size_t size) {
-	//RDTSC(start);
+
+	LOCK_HEAP();
+	DIRTY_FILE();
+	LAT_BEGIN(t);
+	addrs_t *bp = vmalloc_request(size);
+	LAT_END(t, LAT_MALLOC, size);
+	UNLOCK_HEAP();
+	return bp;
+}
+
+/* Deallocate the block of M2 at the address stored as an element of RT at address addr.
+* Coalesces and compacts. */
+void VFree(addrs_t *addr) {
+
+	LOCK_HEAP();
+	DIRTY_FILE();
+#ifdef LATENCY_STATS
+	size_t size = ((addr != NULL) && IS_LIVE_HANDLE(addr)) ? GET_SIZE(HDRP(*(addr))) - 2 * WSIZE : 0;
+#endif
+	LAT_BEGIN(t);
+	vfree_request(addr);
+	LAT_END(t, LAT_FREE, size);
+	UNLOCK_HEAP();
+}
+
+/* Helper function for VMalloc */
+static addrs_t *vmalloc_request(size_t size) {
+
 	/* check bad requests */
 	if (baseptr == 0) {
 		printf("M2 uninitialized \n");
@@ -115,59 +800,78 @@ addrs_t *VMalloc(size_t size) {
 		size_t asize;
 
 		/* adjust payload for alignment and overhead */
-		if (size <= 8)	
-			asize = 16;
-		else
-			asize = 8 * ((size + 15) / 8);
-
-		if (GET_SIZE(HDRP(baseptr)) >= asize) {     //fit found
-			int i;
-			for (i = 0; i < MAX_NUM_BLOCKS; i++) {
-				
-				if (RT[i] == NULL) {
-					RT[i] = baseptr;
-					place(baseptr, asize);
-
-				/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_malloc_cycles += time;
-	avg_malloc_cycles = total_malloc_cycles / total_malloc_reqs; */
+		asize = ASIZE(size);
+
+		addrs_t *bp;
+		addrs_t bpM;
+
+		if (compact_mode == COMPACT_INCREMENTAL)
+			compact_slice(compact_budget);
+
+		/* holes and free chunk together fit, compacting merges them */
+		if (((bpM = find_fit(asize)) == NULL) && (hole_bytes + GET_SIZE(HDRP(baseptr)) >= asize)) {
+			compact_slice(SIZE_MAX);
+			bpM = find_fit(asize);
+		}
+
+		if ((bpM != NULL) && ((bp = get_handle()) != NULL)) {     //fit found
+			if (bpM != baseptr)
+				remove_hole(bpM);
+			*(bp) = bpM;
+			place(bpM, asize, bp);
 					
-					return (RT + i);
-				}
-			}
+			return bp;
 		}
 		
 		else	//not fit
-			/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_malloc_cycles += time;
-	avg_malloc_cycles = total_malloc_cycles / total_malloc_reqs; */
-			
 			return NULL;
 		
 	}
 
 }
 
-/* Deallocate the block of M2 at the address stored as an element of RT at address addr.
-* Coalesces and compacts. */
-void VFree(addrs_t *addr) {
-	//RDTSC(start)
+/* Helper function for VFree */
+static void vfree_request(addrs_t *addr) {
+
 	/* check bad requests */
 	if (baseptr == 0) { 
 		printf("%s", "M2 uninitialized \n");
 		return;
 	}	
 
-	if ((addr == NULL) || (*(addr) == NULL)) {
+	if ((addr == NULL) || !IS_LIVE_HANDLE(addr)) {
 		printf("%s", "invalid address \n");
 		return;
 	}
 
 	addrs_t addrM = *(addr);
+	put_handle(addr);
+	release(addrM);
+
+	if (compact_mode == COMPACT_INCREMENTAL)
+		compact_slice(compact_budget);
+}
+
+/* Helper function for VFree and VRealloc.
+ * Frees block addrM, which no RT entry refers to any more, by coalescing it
+ * with the free chunk if it is the last block and by compacting otherwise.
+ * Unless compaction is eager, other blocks are left as holes instead.
+ * Eager compaction with pinned or aligned blocks, or with holes pinned blocks
+ * kept open, slides block by block as compact_slice does. */
+static void release(addrs_t addrM) {
+
+	if ((compact_mode != COMPACT_EAGER) || (num_pinned > 0) || (num_aligned > 0) || (holes != NULL)) {
+
+		leave_hole(addrM);
+		if ((compact_mode == COMPACT_EAGER) || ((compact_mode == COMPACT_DEFERRED) &&
+			(hole_bytes * 100 > compact_threshold * (size_t)(baseptr - heap_lo))))
+			compact_slice(SIZE_MAX);
+		else if ((compact_mode == COMPACT_BACKGROUND) && (holes != NULL))
+			WAKE_COMPACTOR();
+		purge_tail(0);
+		return;
+	}
+
 	size_t size = GET_SIZE(HDRP(addrM));	//size of freed block
 	size_t next_alloc = GET_ALLOC(HDRP(NEXT_BLKP(addrM)));
 
@@ -179,61 +883,689 @@ void VFree(addrs_t *addr) {
 		PUT(FTRP(NEXT_BLKP(addrM)), PACK(size, 0));
 	
 		baseptr = addrM;
-		*(addr) = NULL;
 	}
 
 	else {	//compact and coalesce
 	
-		compact (addrM, addr);
+		compact (addrM);
 	}	
+	purge_tail(0);
+}
+
+/* Takes an unused RT entry off the free list, or the next never used one,
+ * committing the next chunk of RT when needed. Entries never move, so
+ * growing RT leaves handles already handed out valid.
+ * Returns NULL if the table is full. */
+static addrs_t *get_handle() {
+
+	long i;
+
+	if (rt_free >= 0) {
+		i = rt_free;
+		rt_free = NEXT_FREE_HANDLE(RT[i]) - 1;
+	}
+	else {
+		if (rt_used == rt_committed) {		//grow RT
+			if ((rt_committed == rt_cap) ||
+				(mprotect(RT + rt_committed, RT_CHUNK * sizeof(addrs_t), PROT_READ | PROT_WRITE) != 0) ||
+				(mprotect(rt_pins + rt_committed, RT_CHUNK * sizeof(unsigned int), PROT_READ | PROT_WRITE) != 0) ||
+				(mprotect(rt_align + rt_committed, RT_CHUNK * sizeof(unsigned char), PROT_READ | PROT_WRITE) != 0) ||
+				(mprotect(rt_heat + rt_committed, RT_CHUNK * sizeof(unsigned int), PROT_READ | PROT_WRITE) != 0))
+				return NULL;
+			rt_committed += RT_CHUNK;
+		}
+		i = rt_used++;
+	}
+
+	rt_live++;
+	return (RT + i);
+}
+
+/* Puts RT entry h on the free list, dropping any pins, alignment, access
+ * count and root left on it */
+static void put_handle(addrs_t *h) {
+
+	if (rt_pins[h - RT] != 0) {
+		rt_pins[h - RT] = 0;
+		num_pinned--;
+	}
+	if (rt_align[h - RT] != 0) {
+		rt_align[h - RT] = 0;
+		num_aligned--;
+	}
+	rt_heat[h - RT] = 0;
+	if (h - RT == rt_root)
+		rt_root = -1;
+	*(h) = PACK_FREE_HANDLE(rt_free + 1);
+	rt_free = h - RT;
+	rt_live--;
+}
+
+/* Resize the block of M2 at the address stored in RT entry addr to size bytes.
+ * The block keeps its RT entry. Shrinking releases the end of the block,
+ * growing absorbs the free chunk if the block is the last one and otherwise
+ * moves the block into the free chunk and compacts the hole it leaves.
+ * A pinned or aligned block is only resized in place.
+ * Returns addr, or NULL if the free chunk is too small. */
+addrs_t *VRealloc(addrs_t *addr, size_t size) {
+
+	LOCK_HEAP();
+	DIRTY_FILE();
+	addrs_t *bp = vrealloc_request(addr, size);
+	UNLOCK_HEAP();
+	return bp;
+}
+
+/* Helper function for VRealloc */
+static addrs_t *vrealloc_request(addrs_t *addr, size_t size) {
+
+	/* check bad requests */
+	if (baseptr == 0) {
+		printf("%s", "M2 uninitialized \n");
+		return NULL;
+	}
+	if (addr == NULL)
+		return VMalloc(size);
+	if (!IS_LIVE_HANDLE(addr)) {
+		printf("%s", "invalid address \n");
+		return NULL;
+	}
+	if (size == 0) {
+		VFree(addr);
+		return NULL;
+	}
+
+	size_t asize;
+
+	/* adjust payload for alignment and overhead */
+	asize = ASIZE(size);
+
+	addrs_t addrM = *(addr);
+	size_t csize = GET_SIZE(HDRP(addrM));
+
+	if (asize <= csize) {	//shrink, release the end as its own block
+
+		if ((csize - asize) >= MIN_BLOCK) {
+			PUT(HDRP(addrM), PACK(asize, 1));
+			PUT(FTRP(addrM), PACK_OWNER(addr));
+
+			addrs_t rest = NEXT_BLKP(addrM);
+			PUT(HDRP(rest), PACK(csize - asize, 1));
+			PUT(FTRP(rest), PACK(csize - asize, 1));
+			release(rest);
+		}
+		return addr;
+	}
+
+	int attempt;
+	for (attempt = 0; attempt < 2; attempt++) {
+
+		addrs_t next = NEXT_BLKP(addrM);
+		size_t size_free = GET_SIZE(HDRP(next));
+
+		if (!GET_ALLOC(HDRP(next)) && (csize + size_free >= asize)) {	//grow into free chunk or hole
+
+			if (next != baseptr)
+				remove_hole(next);
+			PUT(HDRP(addrM), PACK(csize + size_free, 0));
+			PUT(FTRP(addrM), PACK(csize + size_free, 0));
+			place(addrM, asize, addr);
+			return addr;
+		}
 
-/*RDTSC(finish);
-	long time = (long)(finish - start);
-	total_cycles += time;
-	total_malloc_cycles += time;
-	avg_malloc_cycles = total_malloc_cycles / total_malloc_reqs; */
- 
-}	
+		addrs_t newM = (IS_PINNED(addrM) || BLK_ALIGN(addrM)) ? NULL : find_fit(asize);
+		if (newM != NULL) {	//move into free chunk or hole
 
-/* Updates header and footer for newly allocated block.
-* Splits free block if one of a minimum size 16 can be made. */
-static void place (void *bp, size_t asize) {
+			if (newM != baseptr)
+				remove_hole(newM);
+			place(newM, asize, addr);
+			memcpy(newM, addrM, csize - 2 * WSIZE);
+			*(addr) = newM;
+
+			release(addrM);		//compaction slides the moved block and its RT entry down
+			return addr;
+		}
+
+		if (hole_bytes == 0)
+			break;
+		compact_slice(SIZE_MAX);	//merge the holes into the free chunk and retry
+		addrM = *(addr);
+	}
+
+	return NULL;	//no fit
+}
+
+/* Allocate size bytes in M2 at an address that is a multiple of align, a
+ * power of two up to the page size. The padding in front of the block is
+ * left as a hole for other blocks, and compaction only slides the block by
+ * multiples of align. VRealloc resizes the block in place only. */
+addrs_t *VMallocAligned(size_t size, size_t align) {
+
+	addrs_t *bp = NULL;
+	addrs_t bpM;
+
+	if ((align == 0) || (align & (align - 1)) || (align > (size_t)sysconf(_SC_PAGESIZE))) {
+		printf("invalid alignment %zu \n", align);
+		return NULL;
+	}
+	if (align <= 8)
+		return VMalloc(size);
+
+	LOCK_HEAP();
+	DIRTY_FILE();
+	LAT_BEGIN(t);
+	if (baseptr == 0)
+		printf("M2 uninitialized \n");
+	else if (size == 0)
+		printf("cannot malloc zero bytes \n");
+	else {
+		size_t asize = ASIZE(size);
+
+		/* holes and free chunk together fit, compacting merges them */
+		if (((bpM = find_aligned_fit(asize, align)) == NULL) &&
+			(hole_bytes + GET_SIZE(HDRP(baseptr)) >= asize + align + MIN_BLOCK)) {
+			compact_slice(SIZE_MAX);
+			bpM = find_aligned_fit(asize, align);
+		}
+
+		if ((bpM != NULL) && ((bp = get_handle()) != NULL)) {
+			addrs_t a = align_payload(bpM, align);
+
+			if (bpM != baseptr)
+				remove_hole(bpM);
+			if (a != bpM) {		//split off the padding as a hole
+				size_t csize = GET_SIZE(HDRP(bpM));
+
+				PUT(HDRP(bpM), PACK(a - bpM, 0));
+				PUT(FTRP(bpM), PACK(a - bpM, 0));
+				insert_hole(bpM);
+				PUT(HDRP(a), PACK(csize - (a - bpM), 0));
+				PUT(FTRP(a), PACK(csize - (a - bpM), 0));
+				if (bpM == baseptr)
+					baseptr = a;
+			}
+			*(bp) = a;
+			place(a, asize, bp);
+			rt_align[bp - RT] = __builtin_ctzll(align);
+			num_aligned++;
+		}
+	}
+	LAT_END(t, LAT_MALLOC, size);
+	UNLOCK_HEAP();
+	return bp;
+}
+
+/* Sets how VFree deals with the hole a block leaves.
+ * COMPACT_EAGER slides the following blocks down right away. COMPACT_DEFERRED
+ * keeps holes for VMalloc to reuse and compacts all of M2 once holes exceed
+ * threshold percent of its used part. COMPACT_INCREMENTAL keeps holes and
+ * slides at most budget bytes of blocks on each VMalloc and VFree. */
+void VSetCompaction(int mode, int threshold, size_t budget) {
+
+	LOCK_HEAP();
+	DIRTY_FILE();
+	compact_mode = mode;
+	compact_threshold = threshold;
+	compact_budget = budget;
+
+	if ((mode == COMPACT_EAGER) && (baseptr != 0))
+		compact_slice(SIZE_MAX);
+	UNLOCK_HEAP();
+}
+
+/* Turns locality mode on or off. In it, VTouch, VPut, VBorrow and VPin count
+ * accesses to the block of each RT entry, and compaction gathers the most
+ * accessed blocks at the front of M2 so they share cache lines and pages.
+ * VGet frees its block, so it isn't counted. */
+void VSetLocality(int on) {
+
+	LOCK_HEAP();
+	locality = on;
+	UNLOCK_HEAP();
+}
+
+/* Counts an access to the block of RT entry addr for locality mode, for
+ * callers that dereference *addr themselves */
+void VTouch(addrs_t *addr) {
+
+	LOCK_HEAP();
+	if ((baseptr != 0) && (addr != NULL) && IS_LIVE_HANDLE(addr))
+		TOUCH(addr);
+	UNLOCK_HEAP();
+}
+
+/* Sets the number of bytes the free chunk must have grown by before it is
+ * purged, 0 to never purge, and how many ms they stay free before they are */
+void VSetPurge(size_t threshold, long decay_ms) {
+
+	LOCK_HEAP();
+	purge_threshold = threshold;
+	purge_decay = (decay_ms > 0) ? decay_ms : 0;
+	UNLOCK_HEAP();
+}
+
+/* Hands the dirty pages of the free chunk back to the OS now, without
+ * waiting for them to decay. Returns the bytes purged. */
+size_t VPurge() {
+
+	size_t purged = 0;
+
+	LOCK_HEAP();
+	if (baseptr != 0)
+		purged = purge_tail(1);
+	UNLOCK_HEAP();
+	return purged;
+}
+
+/* Helper function for release, VFreeBatch, the compactor and VPurge.
+ * Purges the pages of the free chunk below purged_from once there are
+ * purge_threshold bytes of them and they have been free for purge_decay ms,
+ * or right away if all is set. The chunk's header and footer stay put.
+ * Returns the bytes purged. */
+static size_t purge_tail(int all) {
+
+	if ((purge_threshold == 0) || (baseptr >= purged_from)) {
+		tail_dirty_since = 0;
+		return 0;
+	}
+	if (!all && ((++purge_ticks % PURGE_INTERVAL) != 0))
+		return 0;
+
+	long long now = now_ms();
+
+	if (tail_dirty_since == 0)
+		tail_dirty_since = now;
+	if (!all && (((size_t)(purged_from - baseptr) < purge_threshold) || (now - tail_dirty_since < purge_decay)))
+		return 0;
+
+	/* whole pages between the header and purged_from or the footer */
+	addrs_t top = (purged_from < FTRP(baseptr)) ? purged_from : FTRP(baseptr);
+	addrs_t lo = (addrs_t)(((unsigned long long)baseptr + purge_page - 1) & ~(unsigned long long)(purge_page - 1));
+	addrs_t hi = (addrs_t)((unsigned long long)top & ~(unsigned long long)(purge_page - 1));
+	size_t purged = 0;
+
+	if ((hi > lo) && (madvise(lo, hi - lo, PURGE_ADVICE) == 0))
+		purged = hi - lo;
+	purged_from = baseptr;
+	tail_dirty_since = 0;
+	purged_bytes += purged;
+	return purged;
+}
+
+/* Milliseconds on a coarse monotonic clock, never 0 */
+static long long now_ms() {
+
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000 + 1;
+}
+
+/* Updates header and footer for newly allocated block owned by RT entry h.
+* Splits free block if one of a minimum size 16 can be made.
+* bp is the free chunk at the end of M2 or a hole already off the hole list. */
+static void place (void *bp, size_t asize, addrs_t *h) {
 
 	size_t csize = GET_SIZE(HDRP(bp));
+	int tail = (GET_SIZE(HDRP(NEXT_BLKP(bp))) == 0);	//followed by the epilogue
 
-	if ((csize - asize) >= 16) {	//split block and create free block
+	if ((csize - asize) >= MIN_BLOCK) {	//split block and create free block
 		
 		PUT(HDRP(bp), PACK(asize, 1));
-		PUT(FTRP(bp), PACK(asize, 1));
+		PUT(FTRP(bp), PACK_OWNER(h));
 
 		bp = NEXT_BLKP(bp);
 
 		PUT(HDRP(bp), PACK(csize - asize, 0));
 		PUT(FTRP(bp), PACK(csize - asize, 0));
 
-		baseptr = bp;
+		if (tail)
+			baseptr = bp;
+		else
+			insert_hole(bp);
 	}
 
 	else {		//can't make free block of minimum size
 		
 		PUT(HDRP(bp), PACK(csize, 1));
-		PUT(FTRP(bp), PACK(csize, 1));
+		PUT(FTRP(bp), PACK_OWNER(h));
 		
-		baseptr = NEXT_BLKP(bp);
+		if (tail)
+			baseptr = NEXT_BLKP(bp);
 	}
+
+	if (BLOCK_BYTES() > peak_block_bytes)
+		peak_block_bytes = BLOCK_BYTES();
+	if (baseptr > purged_from)		//the pages taken are in use again
+		purged_from = baseptr;
+}
+
+/* Helper function for release.
+ * Marks block bp free and coalesces it with free neighbours. A block before
+ * the free chunk joins it, any other block goes on the hole list. */
+static void leave_hole(addrs_t bp) {
+
+	size_t size = GET_SIZE(HDRP(bp));
+	addrs_t next = NEXT_BLKP(bp);
+
+	if (!GET_ALLOC(HDRP(bp) - WSIZE)) {		//previous block is a hole
+		bp = PREV_BLKP(bp);
+		remove_hole(bp);
+		size += GET_SIZE(HDRP(bp));
+	}
+
+	if (next == baseptr) {			//join the free chunk
+		size += GET_SIZE(HDRP(next));
+		PUT(HDRP(bp), PACK(size, 0));
+		PUT(FTRP(bp), PACK(size, 0));
+		baseptr = bp;
+		return;
+	}
+
+	if (!GET_ALLOC(HDRP(next))) {		//next block is a hole
+		remove_hole(next);
+		size += GET_SIZE(HDRP(next));
+	}
+
+	PUT(HDRP(bp), PACK(size, 0));
+	PUT(FTRP(bp), PACK(size, 0));
+	insert_hole(bp);
+}
+
+/* Puts hole bp on the hole list, keeping it sorted by address */
+static void insert_hole(addrs_t bp) {
+
+	addrs_t pred = NULL;
+	addrs_t succ = holes;
+
+	while ((succ != NULL) && (succ < bp)) {
+		pred = succ;
+		succ = GET_HOLE(SUCC_HOLE(succ));
+	}
+
+	PUT_HOLE(PRED_HOLE(bp), pred);
+	PUT_HOLE(SUCC_HOLE(bp), succ);
+	if (succ != NULL)
+		PUT_HOLE(PRED_HOLE(succ), bp);
+	if (pred != NULL)
+		PUT_HOLE(SUCC_HOLE(pred), bp);
+	else
+		holes = bp;
+
+	hole_bytes += GET_SIZE(HDRP(bp));
+	num_holes++;
+	hole_hist[size_class(GET_SIZE(HDRP(bp)))]++;
+	if (GET_SIZE(HDRP(bp)) > largest_hole)
+		largest_hole = GET_SIZE(HDRP(bp));
+}
+
+/* Takes hole bp off the hole list */
+static void remove_hole(addrs_t bp) {
+
+	addrs_t pred = GET_HOLE(PRED_HOLE(bp));
+	addrs_t succ = GET_HOLE(SUCC_HOLE(bp));
+
+	if (pred != NULL)
+		PUT_HOLE(SUCC_HOLE(pred), succ);
+	else
+		holes = succ;
+	if (succ != NULL)
+		PUT_HOLE(PRED_HOLE(succ), pred);
+
+	hole_bytes -= GET_SIZE(HDRP(bp));
+	num_holes--;
+	hole_hist[size_class(GET_SIZE(HDRP(bp)))]--;
+	if (GET_SIZE(HDRP(bp)) == largest_hole)
+		largest_stale = 1;
+}
+
+/* Returns the size class of a hole of size bytes */
+static inline int size_class(size_t size) {
+
+	int c = (63 - __builtin_clzll((unsigned long long)size)) - 4;
+	return (c < NUM_CLASSES) ? c : NUM_CLASSES - 1;
+}
+
+/* Returns the lowest hole that fits asize bytes, or the free chunk if none does.
+ * Returns NULL if neither fits. */
+static addrs_t find_fit(size_t asize) {
+
+	addrs_t bp;
+	for (bp = holes; bp != NULL; bp = GET_HOLE(SUCC_HOLE(bp))) {
+		if (GET_SIZE(HDRP(bp)) >= asize)
+			return bp;
+	}
+	return (GET_SIZE(HDRP(baseptr)) >= asize) ? baseptr : NULL;
+}
+
+/* Returns the first payload address at or after bp that is a multiple of
+ * align and leaves room for a minimum size hole in front of it */
+static addrs_t align_payload(addrs_t bp, size_t align) {
+
+	addrs_t a = (addrs_t)(((unsigned long long)bp + align - 1) & ~(unsigned long long)(align - 1));
+	while ((a != bp) && ((size_t)(a - bp) < MIN_BLOCK))
+		a += align;
+	return a;
+}
+
+/* Returns the lowest hole that can hold asize bytes at a payload address
+ * that is a multiple of align, or the free chunk if none can.
+ * Returns NULL if neither can. */
+static addrs_t find_aligned_fit(size_t asize, size_t align) {
+
+	addrs_t bp;
+	for (bp = holes; bp != NULL; bp = GET_HOLE(SUCC_HOLE(bp))) {
+		if ((size_t)(align_payload(bp, align) - bp) + asize <= GET_SIZE(HDRP(bp)))
+			return bp;
+	}
+	return ((size_t)(align_payload(baseptr, align) - baseptr) + asize <= GET_SIZE(HDRP(baseptr))) ? baseptr : NULL;
+}
+
+/* Slides live blocks down over the lowest hole in one pass, stopping once
+ * budget bytes have moved. Holes passed on the way are absorbed and the gap
+ * left behind becomes a hole, or joins the free chunk if it was reached.
+ * A pinned block stays put, the gap before it becomes a hole and sliding
+ * starts over after it. An aligned block moves down to the lowest address
+ * that keeps it aligned, the padding in front of it becomes a hole. The RT entries of the moved blocks are fixed as
+ * they go. Only an unbounded slice reorders hot blocks, so a budgeted one
+ * stays within its pause. Returns the number of bytes moved. */
+static size_t compact_slice(size_t budget) {
+
+	if (holes == NULL)
+		return 0;
+
+	LAT_BEGIN(t);
+	addrs_t dst = holes;
+	addrs_t src = holes;
+	size_t shift = 0;
+	size_t moved = 0;
+
+	while (src != baseptr) {
+
+		if (!GET_ALLOC(HDRP(src))) {	//absorb hole
+			size_t size = GET_SIZE(HDRP(src));
+
+			remove_hole(src);
+			shift += size;
+			src += size;
+			continue;
+		}
+		if (moved >= budget)
+			break;
+
+		if ((shift == 0) || IS_PINNED(src)) {	//nothing to close before src, or src can't move
+			if (shift != 0) {
+				PUT(HDRP(dst), PACK(shift, 0));
+				PUT(FTRP(dst), PACK(shift, 0));
+				insert_hole(dst);
+				shift = 0;
+			}
+			src = NEXT_BLKP(src);
+			dst = src;
+			continue;
+		}
+
+		if (BLK_ALIGN(src)) {		//moves on its own, to an aligned address
+			addrs_t to = align_payload(dst, BLK_ALIGN(src));
+			size_t size = GET_SIZE(HDRP(src));
+
+			if ((size_t)(src - to) < MIN_BLOCK)	//the gap behind it couldn't be a hole
+				to = src;
+			if (to != dst) {	//padding, src itself if it can't move
+				PUT(HDRP(dst), PACK(to - dst, 0));
+				PUT(FTRP(dst), PACK(to - dst, 0));
+				insert_hole(dst);
+			}
+			if (to != src) {
+				memmove(to - WSIZE, src - WSIZE, size);
+				PUBLISH(GET_OWNER(to), to);
+				moved += size;
+			}
+			shift = src - to;
+			src += size;
+			dst = to + size;
+			continue;
+		}
+
+		/* run of live blocks up to the next free, pinned or aligned block or the budget */
+		addrs_t run = src;
+		while ((src != baseptr) && GET_ALLOC(HDRP(src)) && !IS_PINNED(src) && !BLK_ALIGN(src) && (moved < budget)) {
+			moved += GET_SIZE(HDRP(src));
+			src = NEXT_BLKP(src);
+		}
+		memmove(dst - WSIZE, run - WSIZE, src - run);
+
+		addrs_t end = dst + (src - run);
+		for (; dst != end; dst = NEXT_BLKP(dst))
+			PUBLISH(GET_OWNER(dst), dst);
+	}
+
+	/* the gap [dst, src) is free, there is none right after a pinned block */
+	if ((shift != 0) && (src == baseptr)) {
+		size_t size = shift + GET_SIZE(HDRP(baseptr));
+		baseptr = dst;
+		PUT(HDRP(baseptr), PACK(size, 0));
+		PUT(FTRP(baseptr), PACK(size, 0));
+	}
+	else if (shift != 0) {
+		PUT(HDRP(dst), PACK(shift, 0));
+		PUT(FTRP(dst), PACK(shift, 0));
+		insert_hole(dst);
+	}
+	LAT_END(t, LAT_COMPACT, moved);
+	if (budget == SIZE_MAX)
+		reorder_hot();
+	return moved;
+}
+
+/* Helper function for compaction in locality mode.
+ * Once the live blocks have been touched rt_live times since the last
+ * reorder, moves the hot blocks of each run of movable blocks in front of
+ * the cold ones, then halves the access counts. Holes and pinned and
+ * aligned blocks stay put and end the runs. */
+static void reorder_hot() {
+
+	if (!locality || (rt_live == 0) || (heat_touches < rt_live))
+		return;
+
+	LAT_BEGIN(t);
+	unsigned long long total = 0;
+	size_t moved = 0;
+	addrs_t bp = heap_lo + 4 * WSIZE;	//first block
+	long i;
+
+	for (i = 0; i < rt_used; i++)		//free entries count 0
+		total += rt_heat[i];
+
+	while (bp != baseptr) {
+		if (!GET_ALLOC(HDRP(bp)) || IS_PINNED(bp) || BLK_ALIGN(bp)) {
+			bp = NEXT_BLKP(bp);
+			continue;
+		}
+
+		addrs_t run = bp;
+		size_t hot_bytes = 0;
+
+		while ((bp != baseptr) && GET_ALLOC(HDRP(bp)) && !IS_PINNED(bp) && !BLK_ALIGN(bp)) {
+			if (IS_HOT(bp, total))
+				hot_bytes += GET_SIZE(HDRP(bp));
+			bp = NEXT_BLKP(bp);
+		}
+		moved += partition_run(run, bp, hot_bytes, total);
+	}
+
+	for (i = 0; i < rt_used; i++)
+		rt_heat[i] >>= 1;
+	heat_touches = 0;
+	LAT_END(t, LAT_COMPACT, moved);
+}
+
+/* Helper function for reorder_hot.
+ * Moves the hot blocks of the run [run, end), hot_bytes in all, to its
+ * start and the cold ones after them, both in their old order. The hot
+ * blocks are set aside in the free chunk while the cold ones slide down,
+ * then the cold ones move up as one and the hot ones go in front. Returns
+ * the bytes moved, 0 if the hot blocks are in front already or don't fit
+ * in the free chunk. */
+static size_t partition_run(addrs_t run, addrs_t end, size_t hot_bytes, unsigned long long total) {
+
+	addrs_t bp = run;
+	size_t front = 0;
+
+	while ((bp != end) && IS_HOT(bp, total)) {
+		front += GET_SIZE(HDRP(bp));
+		bp = NEXT_BLKP(bp);
+	}
+	if ((hot_bytes == 0) || (front == hot_bytes))
+		return 0;
+
+	addrs_t aside = baseptr;	//payload of the free chunk, after every run
+	addrs_t a = aside;
+	addrs_t dst = run;
+	size_t cold_bytes = (end - run) - hot_bytes;
+
+	if (GET_SIZE(HDRP(baseptr)) < hot_bytes + 2 * WSIZE)
+		return 0;
+	for (bp = run; bp != end; ) {
+		size_t size = GET_SIZE(HDRP(bp));
+		addrs_t next = bp + size;
+
+		if (IS_HOT(bp, total)) {
+			memcpy(a, bp - WSIZE, size);
+			a += size;
+		}
+		else {
+			if (dst != bp)
+				memmove(dst - WSIZE, bp - WSIZE, size);
+			dst += size;
+		}
+		bp = next;
+	}
+	/* the copy faulted purged pages of the free chunk back in */
+	addrs_t dirty = (addrs_t)(((unsigned long long)(aside + hot_bytes) + purge_page - 1) & ~(unsigned long long)(purge_page - 1));
+	if (dirty > purged_from)
+		purged_from = dirty;
+
+	memmove(run - WSIZE + hot_bytes, run - WSIZE, cold_bytes);
+	memcpy(run - WSIZE, aside, hot_bytes);
+
+	for (bp = run; bp != end; bp = NEXT_BLKP(bp))
+		PUBLISH(GET_OWNER(bp), bp);
+	return hot_bytes + 2 * cold_bytes;
 }
 
 /* Performs compaction for VFree.
  * Removes reorganizes blocks and coalesces so there is one free chunk */
-static void *compact(void *bpM, addrs_t *bp) {
+static void compact(void *bpM) {
 		
+	LAT_BEGIN(t);
 	/* copy allocated blocks over to fill the gap */
-	int free_extend = GET_SIZE(HDRP(bpM));
+	size_t free_extend = GET_SIZE(HDRP(bpM));
 	size_t size = GET_SIZE(HDRP(baseptr)) + free_extend;
 	addrs_t copy_bpM = NEXT_BLKP(bpM);
-	int bytes_copied = ADDR_DIFF(baseptr - 4, copy_bpM);
+	size_t bytes_copied = ADDR_DIFF(baseptr, copy_bpM);	//up to and including the footer of the last block
 
-	memcpy(bpM - 4, copy_bpM - 4, bytes_copied);
+	memmove(bpM - WSIZE, copy_bpM - WSIZE, bytes_copied);
 	
 	/* update free block */	
 	baseptr -= free_extend;
@@ -241,45 +1573,163 @@ static void *compact(void *bpM, addrs_t *bp) {
 	PUT(HDRP(baseptr), PACK(size, 0));
 	PUT(FTRP(baseptr), PACK(size, 0));
 	
-	/* update redirection table */	
-	*(bp) = NULL;
-	
-	addrs_t runner_bpM = bpM;
-	int i;
-	for (i = 0; i < MAX_NUM_BLOCKS; i++) {
-		if ((RT[i] != NULL) && (RT[i] >= bpM)) {
-			RT[i] -= free_extend;
-		}
-	}
-	 	
+	/* update RT entries of the moved blocks */
+	addrs_t bp;
+	for (bp = bpM; bp != baseptr; bp = NEXT_BLKP(bp))
+		PUBLISH(GET_OWNER(bp), bp);
+
+	LAT_END(t, LAT_COMPACT, bytes_copied);
+	reorder_hot();
 }
 
 /* Copy size bytes from data into malloced region */
 addrs_t *VPut(any_t data, size_t size){
 
 	/* check bad requests */
-	if (baseptr == 0) {
-		printf("%s", "M2 uninitialized \n");
-		return NULL;
-	}
 	if (data == NULL) {
 		printf("%s", "invalid data address \n");
 		return NULL;
 	}
 
+	LOCK_HEAP();
+	if (baseptr == 0) {
+		printf("%s", "M2 uninitialized \n");
+		UNLOCK_HEAP();
+		return NULL;
+	}
+
 	/* malloc and copy bytes */
 	addrs_t *bp = VMalloc(size);
 
-	if (bp == NULL)	//no fit 	
-		return NULL;
-	else {
+	if (bp != NULL) {
 		char *data_char = (char *) data;
 		addrs_t bpM = *(bp);
 
 		memcpy(bpM, data_char, size);
-			
-		return bp;
+		TOUCH(bp);
+	}
+	UNLOCK_HEAP();
+	return bp;
+}
+
+/* Allocate n blocks of size bytes in M2 and store their RT entries in out.
+ * Each fit search looks for room for all remaining blocks, and the hole or
+ * free chunk found is cut into as many blocks as fit. Blocks the batch can't
+ * place are left to VMalloc. Returns how many were allocated. */
+int VMallocBatch(size_t size, int n, addrs_t **out) {
+
+	size_t asize;
+	int i = 0;
+
+	LOCK_HEAP();
+	if (baseptr == 0) {
+		printf("M2 uninitialized \n");
+		UNLOCK_HEAP();
+		return 0;
 	}
+	DIRTY_FILE();
+
+	/* adjust payload for alignment and overhead */
+	asize = ASIZE(size);
+
+	while ((size != 0) && (i < n)) {
+
+		addrs_t bpM = find_fit(asize * (n - i));
+		if ((bpM == NULL) && ((bpM = find_fit(asize)) == NULL))
+			break;
+
+		/* one RT entry per block that fits */
+		int k = 0;
+		size_t fits = GET_SIZE(HDRP(bpM)) / asize;
+		if (fits > (size_t)(n - i))
+			fits = n - i;
+		while ((k < (int)fits) && ((out[i + k] = get_handle()) != NULL))
+			k++;
+		if (k == 0)
+			break;
+
+		if (bpM != baseptr)
+			remove_hole(bpM);
+		place(bpM, k * asize, out[i]);
+
+		/* cut the run into k blocks, the last one keeps any rest place left */
+		size_t rest = GET_SIZE(HDRP(bpM));
+		for (; k > 1; k--) {
+			PUT(HDRP(bpM), PACK(asize, 1));
+			PUT(FTRP(bpM), PACK_OWNER(out[i]));
+			*(out[i++]) = bpM;
+			bpM += asize;
+			rest -= asize;
+			PUT(HDRP(bpM), PACK(rest, 1));
+		}
+		PUT(FTRP(bpM), PACK_OWNER(out[i]));
+		*(out[i++]) = bpM;
+	}
+
+	while ((i < n) && ((out[i] = VMalloc(size)) != NULL))
+		i++;
+	UNLOCK_HEAP();
+	return i;
+}
+
+/* Deallocate the n blocks of M2 whose RT entries are in addrs with a single
+ * compaction. All blocks are left as holes first, then one sliding pass
+ * closes them, or the compaction policy decides as for one VFree. */
+void VFreeBatch(addrs_t **addrs, int n) {
+
+	int i;
+
+	LOCK_HEAP();
+	if (baseptr == 0) { 
+		printf("%s", "M2 uninitialized \n");
+		UNLOCK_HEAP();
+		return;
+	}
+	DIRTY_FILE();
+
+	for (i = 0; i < n; i++) {
+		addrs_t *addr = addrs[i];
+
+		if ((addr == NULL) || !IS_LIVE_HANDLE(addr)) {
+			printf("%s", "invalid address \n");
+			continue;
+		}
+
+		addrs_t addrM = *(addr);
+		put_handle(addr);
+		leave_hole(addrM);
+	}
+
+	if (compact_mode == COMPACT_EAGER)
+		compact_slice(SIZE_MAX);
+	else if ((compact_mode == COMPACT_DEFERRED) &&
+		(hole_bytes * 100 > compact_threshold * (size_t)(baseptr - heap_lo)))
+		compact_slice(SIZE_MAX);
+	else if (compact_mode == COMPACT_INCREMENTAL)
+		compact_slice(compact_budget);
+	else if ((compact_mode == COMPACT_BACKGROUND) && (holes != NULL))
+		WAKE_COMPACTOR();
+	purge_tail(0);
+	UNLOCK_HEAP();
+}
+
+/* Copy n records of size bytes, stored back to back at data, into blocks
+ * allocated with VMallocBatch. Returns how many were stored in out. */
+int VPutBatch(any_t data, size_t size, int n, addrs_t **out) {
+
+	if (data == NULL) {
+		printf("%s", "invalid data address \n");
+		return 0;
+	}
+
+	LOCK_HEAP();
+	int i, got = VMallocBatch(size, n, out);
+	char *data_char = (char *) data;
+
+	for (i = 0; i < got; i++)
+		memcpy(*(out[i]), data_char + i * size, size);
+	UNLOCK_HEAP();
+	return got;
 }
 
 /* Copy size bytes of region of M2 pointed to entry of RT addr into return_data.
@@ -287,16 +1737,20 @@ addrs_t *VPut(any_t data, size_t size){
 void VGet(any_t return_data, addrs_t *addr, size_t size) {
 	
 	/* check bad requests */
-	if (baseptr == 0) {
-		printf("%s", "M2 uninitialized \n");
-		return;
-	}
 	if (return_data == NULL) {
 		printf("%s", "invalid return_data address \n");
 		return;
 	}
-	if ((addr == NULL) || (*(addr) == NULL)) {
+
+	LOCK_HEAP();
+	if (baseptr == 0) {
+		printf("%s", "M2 uninitialized \n");
+		UNLOCK_HEAP();
+		return;
+	}
+	if ((addr == NULL) || !IS_LIVE_HANDLE(addr)) {
 		printf("%s", "invalid addr address \n");
+		UNLOCK_HEAP();
 		return;
 	}
 	
@@ -307,5 +1761,337 @@ void VGet(any_t return_data, addrs_t *addr, size_t size) {
 	memcpy(return_data_char, addrM, size);
 			
 	VFree(addr);
+	UNLOCK_HEAP();
 	
 }
+
+/* Pins the block of RT entry addr so compaction leaves it where it is, and
+ * returns its address, which stays valid until the matching VUnpin. Pins
+ * nest. Returns NULL if addr is not a live entry. */
+addrs_t VPin(addrs_t *addr) {
+
+	LOCK_HEAP();
+	if ((baseptr == 0) || (addr == NULL) || !IS_LIVE_HANDLE(addr)) {
+		printf("%s", "invalid address \n");
+		UNLOCK_HEAP();
+		return NULL;
+	}
+	if (rt_pins[addr - RT]++ == 0)
+		num_pinned++;
+	TOUCH(addr);
+	addrs_t addrM = *(addr);
+	UNLOCK_HEAP();
+	return addrM;
+}
+
+/* Drops a pin of VPin. Once the block of RT entry addr is unpinned,
+ * compaction may move it again and close the holes kept around it. */
+void VUnpin(addrs_t *addr) {
+
+	LOCK_HEAP();
+	if ((baseptr == 0) || (addr == NULL) || !IS_LIVE_HANDLE(addr) || (rt_pins[addr - RT] == 0)) {
+		printf("%s", "invalid address \n");
+		UNLOCK_HEAP();
+		return;
+	}
+	if (--rt_pins[addr - RT] == 0) {
+		num_pinned--;
+		DIRTY_FILE();
+		if ((compact_mode == COMPACT_EAGER) && (num_pinned == 0))
+			compact_slice(SIZE_MAX);
+		else if ((compact_mode == COMPACT_BACKGROUND) && (holes != NULL))
+			WAKE_COMPACTOR();
+	}
+	UNLOCK_HEAP();
+}
+
+/* Zero-copy counterpart of VPut. Returns the RT entry of a block of size
+ * bytes for the caller to write the record into through *addr, or NULL if
+ * nothing fits. With the background compactor the block stays pinned
+ * until VCommit. */
+addrs_t *VReserve(size_t size) {
+
+	LOCK_HEAP();
+	if (baseptr == 0) {
+		printf("%s", "M2 uninitialized \n");
+		UNLOCK_HEAP();
+		return NULL;
+	}
+	addrs_t *addr = VMalloc(size);
+#ifdef BACKGROUND_COMPACT
+	if (addr != NULL)
+		VPin(addr);
+#endif
+	UNLOCK_HEAP();
+	return addr;
+}
+
+/* Finishes a VReserve once size bytes of it are written. A smaller size
+ * gives the rest of the block back, size 0 frees the block. The record
+ * keeps its RT entry addr. */
+addrs_t *VCommit(addrs_t *addr, size_t size) {
+
+	LOCK_HEAP();
+	if ((addr == NULL) || !IS_LIVE_HANDLE(addr)) {
+		printf("%s", "invalid address \n");
+		UNLOCK_HEAP();
+		return NULL;
+	}
+#ifdef BACKGROUND_COMPACT
+	if (rt_pins[addr - RT] != 0)
+		VUnpin(addr);
+#endif
+	if (size < GET_SIZE(HDRP(*(addr))) - 2 * WSIZE)
+		addr = VRealloc(addr, size);
+	UNLOCK_HEAP();
+	return addr;
+}
+
+/* Fills st with the fragmentation statistics of M2. The counters are kept up
+ * to date as blocks are placed and holes come and go, the hole list is only
+ * searched for the largest hole after the last one known has left it. */
+void VHeapStats(struct heap_stats *st) {
+
+	LOCK_HEAP();
+	memset(st, 0, sizeof(*st));
+	if (baseptr != 0) {
+		size_t chunk = GET_SIZE(HDRP(baseptr));	//0 if M2 is full
+		addrs_t bp;
+
+		if (largest_stale) {
+			largest_hole = 0;
+			for (bp = holes; bp != NULL; bp = GET_HOLE(SUCC_HOLE(bp)))
+				if (GET_SIZE(HDRP(bp)) > largest_hole)
+					largest_hole = GET_SIZE(HDRP(bp));
+			largest_stale = 0;
+		}
+
+		memcpy(st->free_hist, hole_hist, sizeof(hole_hist));
+		st->alloc_blks = rt_live;
+		st->block_bytes = BLOCK_BYTES();
+		st->alloc_bytes = st->block_bytes - 2 * WSIZE * rt_live;
+		st->peak_block_bytes = peak_block_bytes;
+		st->purged_bytes = purged_bytes;
+		st->free_blks = num_holes;
+		st->free_bytes = hole_bytes + chunk;
+		st->largest_free = (chunk > largest_hole) ? chunk : largest_hole;
+		if (chunk != 0) {
+			st->free_hist[size_class(chunk)]++;
+			st->free_blks++;
+		}
+	}
+	st->external_frag = st->free_bytes ? 1.0 - (double)st->largest_free / st->free_bytes : 0;
+	st->internal_frag = st->block_bytes ? 1.0 - (double)st->alloc_bytes / st->block_bytes : 0;
+	UNLOCK_HEAP();
+}
+
+/* Zero-copy counterpart of VGet. Returns where the record of RT entry addr
+ * is in M2. The pointer stays valid until the next call that can compact:
+ * VMalloc, VFree, VRealloc and their variants. With the background
+ * compactor the block is pinned instead, until VRelease. */
+any_t VBorrow(addrs_t *addr) {
+
+	LOCK_HEAP();
+	if ((baseptr == 0) || (addr == NULL) || !IS_LIVE_HANDLE(addr)) {
+		printf("%s", "invalid address \n");
+		UNLOCK_HEAP();
+		return NULL;
+	}
+#ifdef BACKGROUND_COMPACT
+	any_t data = (any_t)VPin(addr);		//counts the access
+#else
+	TOUCH(addr);
+	any_t data = (any_t)*(addr);
+#endif
+	UNLOCK_HEAP();
+	return data;
+}
+
+/* Ends a VBorrow of the record of RT entry addr and frees its block
+ * without copying */
+void VRelease(addrs_t *addr) {
+
+	VFree(addr);	//drops the pin of VBorrow
+}
+
+#ifdef BACKGROUND_COMPACT
+/* Helper function for LOCK_HEAP */
+static void init_m2_lock() {
+
+	pthread_mutexattr_t attr;
+
+	pthread_mutexattr_init(&attr);
+	pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+	pthread_mutex_init(&m2_lock, &attr);
+	pthread_mutexattr_destroy(&attr);
+}
+
+/* Body of the compactor thread. Slides compact_budget bytes at a time,
+ * dropping m2_lock between slices, and sleeps while there are no holes
+ * or the last slice could move nothing because of pins. */
+static void *compactor_main(void *arg) {
+
+	int stalled = 0;
+
+	(void)arg;
+
+	LOCK_HEAP();
+	while (compactor_running) {
+
+		if ((holes == NULL) || stalled || (compact_mode != COMPACT_BACKGROUND)) {
+			pthread_cond_wait(&compactor_cond, &m2_lock);
+			stalled = 0;
+			continue;
+		}
+
+		size_t before = hole_bytes;
+		DIRTY_FILE();
+		stalled = ((compact_slice(compact_budget) == 0) && (hole_bytes == before));
+		purge_tail(0);
+
+		UNLOCK_HEAP();
+		sched_yield();
+		LOCK_HEAP();
+	}
+	UNLOCK_HEAP();
+	return NULL;
+}
+
+/* Starts a thread that closes holes in the background. VFree then only
+ * leaves a hole and returns. Other threads must pin a block with VPin before
+ * dereferencing its RT entry outside of the V functions.
+ * Returns 0, or -1 if the thread can't be created. */
+int VStartCompactor() {
+
+	int err = 0;
+
+	LOCK_HEAP();
+	if (!compactor_running) {
+		compactor_prev_mode = compact_mode;
+		compact_mode = COMPACT_BACKGROUND;
+		compactor_running = 1;
+		if (pthread_create(&compactor, NULL, compactor_main, NULL) != 0) {
+			printf("%s", "can't start compactor \n");
+			compactor_running = 0;
+			compact_mode = compactor_prev_mode;
+			err = -1;
+		}
+	}
+	UNLOCK_HEAP();
+	return err;
+}
+
+/* Stops the compactor thread and goes back to the compaction policy in use
+ * before VStartCompactor */
+void VStopCompactor() {
+
+	LOCK_HEAP();
+	if (!compactor_running) {
+		UNLOCK_HEAP();
+		return;
+	}
+	compactor_running = 0;
+	WAKE_COMPACTOR();
+	UNLOCK_HEAP();
+
+	pthread_join(compactor, NULL);
+	VSetCompaction(compactor_prev_mode, compact_threshold, compact_budget);
+}
+#endif
+
+#ifdef LATENCY_STATS
+/* Helper function for VMalloc, VFree and compaction.
+ * Adds a call of op for size bytes that took cycles cycles. */
+static void lat_record(int op, size_t size, unsigned long long cycles) {
+
+	int c = (size > 1) ? 63 - __builtin_clzll(size) : 0;
+	int b = (cycles > 1) ? 63 - __builtin_clzll(cycles) : 0;
+
+	if (c >= LAT_CLASSES)
+		c = LAT_CLASSES - 1;
+	if (b >= LAT_BUCKETS)
+		b = LAT_BUCKETS - 1;
+
+	lat_hist[op][c][b]++;
+	lat_total[op] += cycles;
+	if (cycles > lat_max[op][c])
+		lat_max[op][c] = cycles;
+}
+
+/* Helper function for VLatencyStats.
+ * Returns the upper bound of the bucket holding the permille-th call of hist. */
+static unsigned long long lat_percentile(unsigned long long *hist, unsigned long long count, int permille) {
+
+	unsigned long long rank = (count * permille + 999) / 1000;
+	unsigned long long seen = 0;
+	int b;
+
+	for (b = 0; b < LAT_BUCKETS - 1; b++) {
+		seen += hist[b];
+		if (seen >= rank)
+			break;
+	}
+	return (2ULL << b) - 1;
+}
+
+/* Fills st with the latency of op (LAT_MALLOC, LAT_FREE or LAT_COMPACT)
+ * for size class cls, or for all classes if cls is -1 */
+void VLatencyStats(int op, int cls, struct lat_stats *st) {
+
+	unsigned long long hist[LAT_BUCKETS] = { 0 };
+	int c, b;
+
+	memset(st, 0, sizeof(*st));
+	for (c = 0; c < LAT_CLASSES; c++) {
+		if ((cls >= 0) && (c != cls))
+			continue;
+		for (b = 0; b < LAT_BUCKETS; b++) {
+			hist[b] += lat_hist[op][c][b];
+			st->count += lat_hist[op][c][b];
+		}
+		if (lat_max[op][c] > st->max)
+			st->max = lat_max[op][c];
+	}
+	if (st->count == 0)
+		return;
+
+	st->p50 = lat_percentile(hist, st->count, 500);
+	st->p99 = lat_percentile(hist, st->count, 990);
+	st->p999 = lat_percentile(hist, st->count, 999);
+	if (st->p50 > st->max)
+		st->p50 = st->max;
+	if (st->p99 > st->max)
+		st->p99 = st->max;
+	if (st->p999 > st->max)
+		st->p999 = st->max;
+}
+
+/* Prints averages, percentiles and max of every operation,
+ * the counterpart of the latency part of HEAP_CHECKER for M2 */
+void VLATENCY_REPORT() {
+
+	const char *names[LAT_OPS] = { "VMalloc", "VFree", "compaction" };
+	struct lat_stats st;
+	int op;
+
+	total_cycles = 0;
+	for (op = 0; op < LAT_OPS; op++) {
+		VLatencyStats(op, -1, &st);
+		if (op != LAT_COMPACT)
+			total_cycles += lat_total[op];
+		printf("Average clock cycles for a %s: %llu \n", names[op], st.count ? lat_total[op] / st.count : 0);
+		printf("%s clock cycles p50/p99/p999/max: %llu/%llu/%llu/%llu \n", names[op], st.p50, st.p99, st.p999, st.max);
+	}
+	total_malloc_cycles = lat_total[LAT_MALLOC];
+	total_free_cycles = lat_total[LAT_FREE];
+	printf("Total clock cycles for all requests: %ld \n", total_cycles);
+}
+
+/* Clears all latency histograms */
+void VResetLatencyStats() {
+
+	memset(lat_hist, 0, sizeof(lat_hist));
+	memset(lat_max, 0, sizeof(lat_max));
+	memset(lat_total, 0, sizeof(lat_total));
+}
+#endif
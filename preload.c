@@ -0,0 +1,213 @@
+/* Drop-in replacement for the C library allocator, backed by M1.
+ *
+ * Build it as a shared library and preload it into an unmodified program:
+ *
+ *	gcc -O2 -shared -fPIC -pthread -DCONCURRENT preload.c -o libpa31.so
+ *	LD_PRELOAD=./libpa31.so program
+ *
+ * M1 is initialized on the first call. With -DCONCURRENT every thread gets
+ * an arena and a cache, other builds serialize all calls behind one lock.
+ * The other pa31.c flags work as usual, -DWIDE_HEADERS lifts the 2 GB limit
+ * of M1 for programs that need more. */
+#include <stdio.h>
+#include <string.h>
+#include <stdlib.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <errno.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <pthread.h>
+#ifdef HEAP_PROFILE
+#include <fcntl.h>
+#include <unwind.h>
+#endif
+
+/* Alignment of every block. M1 aligns blocks to 8 bytes by default, the C
+ * library promises 16 so any type fits. -DALIGNMENT=8 saves the padding in
+ * programs that don't need it. */
+#ifndef ALIGNMENT
+#define ALIGNMENT 16
+#endif
+
+/* Keep the heap's own symbols inside the library, so they can't collide
+ * with the program's globals */
+#pragma GCC visibility push(hidden)
+#include "pa31.c"
+#pragma GCC visibility pop
+
+#define EXPORT __attribute__((visibility("default")))
+
+/* Bytes of M1 committed by the first call, arenas grow from there */
+#ifndef PRELOAD_INIT_SIZE
+#define PRELOAD_INIT_SIZE (NUM_ARENAS * HEAP_CHUNK_SIZE)
+#endif
+
+static pthread_once_t init_once = PTHREAD_ONCE_INIT;
+
+#ifdef CONCURRENT
+#define LOCK_SHIM()
+#define UNLOCK_SHIM()
+#else
+static pthread_mutex_t shim_lock = PTHREAD_MUTEX_INITIALIZER;
+#define LOCK_SHIM() pthread_mutex_lock(&shim_lock)
+#define UNLOCK_SHIM() pthread_mutex_unlock(&shim_lock)
+#endif
+
+static void shim_init(){
+	Init(PRELOAD_INIT_SIZE);
+}
+
+/* Helper function for the allocation calls.
+ * Allocates size bytes at a multiple of align, a power of two up to the
+ * page size. Every block is ALIGNMENT aligned, only larger alignments take
+ * the aligned fit search. Zero byte requests get a block of their own. */
+static void *shim_alloc(size_t size, size_t align){
+
+	void *p;
+
+	pthread_once(&init_once, shim_init);
+	if (size == 0)
+		size = 1;
+
+	LOCK_SHIM();
+	p = (align <= ALIGNMENT) ? Malloc(size) : MallocAligned(size, align);
+	UNLOCK_SHIM();
+
+	if (p == NULL)
+		errno = ENOMEM;
+	return p;
+}
+
+/* Helper function for the aligned allocation calls.
+ * Returns 0 and the block in out, or the error code. */
+static int shim_alloc_aligned(void **out, size_t align, size_t size){
+
+	*out = NULL;
+	if ((align == 0) || (align & (align - 1)))
+		return EINVAL;
+	if (align > (size_t)sysconf(_SC_PAGESIZE))	//more than MallocAligned can give
+		return ENOMEM;
+	*out = shim_alloc(size, align);
+	return (*out != NULL) ? 0 : ENOMEM;
+}
+
+EXPORT void *malloc(size_t size){
+	return shim_alloc(size, 8);
+}
+
+EXPORT void free(void *ptr){
+
+	if (ptr == NULL)
+		return;
+	LOCK_SHIM();
+	Free(ptr);
+	UNLOCK_SHIM();
+}
+
+EXPORT void *calloc(size_t n, size_t size){
+
+	size_t total;
+	void *p;
+
+	if (__builtin_mul_overflow(n, size, &total)) {
+		errno = ENOMEM;
+		return NULL;
+	}
+	if ((p = shim_alloc(total, 8)) != NULL)
+		memset(p, 0, total);
+	return p;
+}
+
+EXPORT void *realloc(void *ptr, size_t size){
+
+	void *p;
+
+	if (ptr == NULL)
+		return malloc(size);
+	if (size == 0) {
+		free(ptr);
+		return NULL;
+	}
+
+	LOCK_SHIM();
+	p = Realloc(ptr, size);
+	UNLOCK_SHIM();
+	if (p == NULL)
+		errno = ENOMEM;
+	return p;
+}
+
+EXPORT int posix_memalign(void **memptr, size_t align, size_t size){
+
+	void *p;
+	int err;
+
+	if (align % sizeof(void *))
+		return EINVAL;
+	if ((err = shim_alloc_aligned(&p, align, size)) == 0)
+		*memptr = p;
+	return err;
+}
+
+EXPORT void *memalign(size_t align, size_t size){
+
+	void *p;
+	int err = shim_alloc_aligned(&p, align, size);
+
+	if (err != 0)
+		errno = err;
+	return p;
+}
+
+EXPORT void *aligned_alloc(size_t align, size_t size){
+	return memalign(align, size);
+}
+
+EXPORT void *valloc(size_t size){
+	return memalign(sysconf(_SC_PAGESIZE), size);
+}
+
+EXPORT void *pvalloc(size_t size){
+
+	size_t page = sysconf(_SC_PAGESIZE);
+	return memalign(page, (size + page - 1) & ~(page - 1));
+}
+
+EXPORT size_t malloc_usable_size(void *ptr){
+	return (ptr != NULL) ? usable_size(ptr) : 0;
+}
+
+/* Takes every heap lock across fork, so the child never inherits one held
+ * by a thread that doesn't exist in it */
+static void fork_prepare(){
+
+	pthread_once(&init_once, shim_init);
+#ifdef CONCURRENT
+	int i;
+	for (i = 0; i < NUM_ARENAS; i++)
+		pthread_mutex_lock(&arenas[i].lock);
+#ifdef HEAP_PROFILE
+	pthread_mutex_lock(&prof_lock);		//sampled calls take it too
+#endif
+#else
+	pthread_mutex_lock(&shim_lock);
+#endif
+}
+
+static void fork_release(){
+#ifdef CONCURRENT
+	int i;
+#ifdef HEAP_PROFILE
+	pthread_mutex_unlock(&prof_lock);
+#endif
+	for (i = NUM_ARENAS - 1; i >= 0; i--)
+		pthread_mutex_unlock(&arenas[i].lock);
+#else
+	pthread_mutex_unlock(&shim_lock);
+#endif
+}
+
+__attribute__((constructor)) static void shim_register(){
+	pthread_atfork(fork_prepare, fork_release, fork_release);
+}
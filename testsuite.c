@@ -2,6 +2,8 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <time.h>
+#include <pthread.h>
 
 #define KBLU  "\x1B[34m"
 #define KRED  "\x1B[31m"
@@ -12,9 +14,18 @@
 #define ERROR_ALIGMENT      0x4
 #define ERROR_NOT_FF        0x8
 
+#ifdef ALIGNMENT
+#define ALIGN ALIGNMENT
+#else
 #define ALIGN 8
+#endif
 
-#define rdtsc(x)      __asm__ __volatile__("rdtsc \n\t" : "=A" (*(x)))
+#define rdtsc(x)                                                  \
+  {                                                               \
+    uint32_t lo_, hi_;                                            \
+    __asm__ __volatile__("rdtsc \n\t" : "=a" (lo_), "=d" (hi_)); \
+    *(x) = ((uint64_t)hi_ << 32) | lo_;                           \
+  }
 
 
 #ifdef VHEAP
@@ -23,22 +34,48 @@
   #define INIT(msize)           VInit(msize)
   #define MALLOC(msize)         VMalloc(msize)
   #define FREE(addr, size)      VFree(addr)
+  #define REALLOC(addr,size)    VRealloc(addr,size)
+  #define MALLOC_BATCH(s,n,out) VMallocBatch(s,n,out)
+  #define FREE_BATCH(addrs,n)   VFreeBatch(addrs,n)
+  #define MALLOC_ALIGNED(s,a)   VMallocAligned(s,a)
+  #define RESERVE(size)         VReserve(size)
+  #define COMMIT(addr,size)     VCommit(addr,size)
+  #define BORROW(addr)          VBorrow(addr)
+  #define RELEASE(addr)         VRelease(addr)
   #define PUT(data,size)        VPut(data,size)
   #define GET(rt,addr,size)     VGet(rt,addr,size)
   #define ADDRS                 addrs_t*
   #define LOCATION_OF(addr)     ((size_t)(*addr))
   #define DATA_OF(addr)         (*(*(addr)))
+  #define LATENCY(op,st)        VLatencyStats(op,-1,st)
+  #define MAPPED_BYTES(addr)    0
+  #define HEAP_STATS(st)        VHeapStats(st)
+  #define PURGE()               VPurge()
+  #define SET_PURGE(t,d)        VSetPurge(t,d)
 #else
   #include "pa31.c" // <-- Include solution for part 1
   #define TESTSUITE_STR         "Heap"
   #define INIT(msize)           Init(msize)
   #define MALLOC(msize)         Malloc(msize)
   #define FREE(addr,size)       Free(addr)
+  #define REALLOC(addr,size)    Realloc(addr,size)
+  #define MALLOC_BATCH(s,n,out) MallocBatch(s,n,out)
+  #define FREE_BATCH(addrs,n)   FreeBatch(addrs,n)
+  #define MALLOC_ALIGNED(s,a)   MallocAligned(s,a)
+  #define RESERVE(size)         Reserve(size)
+  #define COMMIT(addr,size)     Commit(addr,size)
+  #define BORROW(addr)          Borrow(addr)
+  #define RELEASE(addr)         Release(addr)
   #define PUT(data,size)        Put(data,size)
   #define GET(rt,addr,size)     Get(rt,addr,size)
   #define ADDRS                 addrs_t
   #define LOCATION_OF(addr)     ((size_t)addr)
   #define DATA_OF(addr)         (*(addr))
+  #define LATENCY(op,st)        LatencyStats(op,-1,st)
+  #define MAPPED_BYTES(addr)    (IN_HEAP(addr) ? 0 : *(size_t *)((addr) - MAPPED_HDR))
+  #define HEAP_STATS(st)        HeapStats(st)
+  #define PURGE()               Purge()
+  #define SET_PURGE(t,d)        SetPurge(t,d)
 #endif
 
 void print_testResult(int code){
@@ -133,13 +170,449 @@ int test_ff(){
   return err;
 }
 
+int test_aligned(){
+  int i, err = 0;
+  size_t align;
+  for (align = 16; align <= 4096; align *= 2){
+    // The block in front is freed, compaction must keep the alignment
+    ADDRS v1 = MALLOC(24);
+    ADDRS v2 = MALLOC_ALIGNED(100, align);
+    ADDRS v3 = MALLOC(8);
+    if (!v1 || !v2 || !v3)
+      return ERROR_OUT_OF_MEM;
+    memset((char *)LOCATION_OF(v2), 7, 100);
+    FREE(v1,24);
+    if (LOCATION_OF(v2) & (align-1))
+      err |= ERROR_ALIGMENT;
+    for (i = 0; i < 100; i++)
+      if (((char *)LOCATION_OF(v2))[i] != 7)
+        err |= ERROR_DATA_INCON;
+    FREE(v2,100);
+    FREE(v3,8);
+  }
+  return err;
+}
+
+int test_stats(){
+  struct heap_stats st0, st1, st2;
+  ADDRS v[16];
+  long blks = 0;
+  int i, err = 0;
+  #ifdef VHEAP
+  VSetCompaction(COMPACT_DEFERRED, 100, 4096); // keep the holes
+  #endif
+  HEAP_STATS(&st0);
+  // Blocks too large for the slab tier and the thread caches
+  for (i = 0; i < 16; i++)
+    if (!(v[i] = MALLOC(1000)))
+      return ERROR_OUT_OF_MEM;
+  HEAP_STATS(&st1);
+  if (st1.alloc_bytes < st0.alloc_bytes + 16*1000 || st1.block_bytes < st1.alloc_bytes ||
+      st1.peak_block_bytes < st1.block_bytes)
+    err |= ERROR_DATA_INCON;
+  // Every other block freed, the bytes move from allocated to free
+  for (i = 0; i < 16; i += 2)
+    FREE(v[i],1000);
+  HEAP_STATS(&st2);
+  for (i = 0; i < NUM_CLASSES; i++)
+    blks += st2.free_hist[i];
+  if (st2.block_bytes + st2.free_bytes != st1.block_bytes + st1.free_bytes ||
+      st2.free_bytes < st1.free_bytes + 8*1000 || blks != st2.free_blks ||
+      st2.largest_free > st2.free_bytes || st2.external_frag <= 0 || st2.external_frag >= 1 ||
+      st2.peak_block_bytes != st1.peak_block_bytes)
+    err |= ERROR_DATA_INCON;
+  for (i = 1; i < 16; i += 2)
+    FREE(v[i],1000);
+  #ifdef VHEAP
+  VSetCompaction(COMPACT_EAGER, 25, 4096);
+  #endif
+  HEAP_STATS(&st2);
+  if (st2.block_bytes != st0.block_bytes || st2.alloc_bytes != st0.alloc_bytes)
+    err |= ERROR_DATA_INCON;
+  return err;
+}
+
+int test_purge(unsigned mem_size){
+  struct heap_stats st0, st1, st2;
+  ADDRS v[8];
+  size_t purged;
+  int i, j, err = 0;
+  HEAP_STATS(&st0);
+  // Blocks under the mmap threshold, freed together they make one large free block
+  for (i = 0; i < 8; i++){
+    if (!(v[i] = MALLOC(64000)))
+      return ERROR_OUT_OF_MEM;
+    memset((char *)LOCATION_OF(v[i]), i + 1, 64000);
+  }
+  for (i = 0; i < 8; i++)
+    FREE(v[i],64000);
+  purged = PURGE();
+  HEAP_STATS(&st1);
+  #ifndef HUGE_PAGES
+  if (purged < 256*1024)
+    err |= ERROR_DATA_INCON;
+  #endif
+  if (st1.purged_bytes < st0.purged_bytes + purged || st1.block_bytes != st0.block_bytes)
+    err |= ERROR_DATA_INCON;
+  // Purged pages can be allocated again
+  for (i = 0; i < 8; i++){
+    if (!(v[i] = MALLOC(64000)))
+      return ERROR_OUT_OF_MEM;
+    memset((char *)LOCATION_OF(v[i]), i + 1, 64000);
+  }
+  for (i = 0; i < 8; i++)
+    for (j = 0; j < 64000; j += 1000)
+      if (((char *)LOCATION_OF(v[i]))[j] != i + 1)
+        err |= ERROR_DATA_INCON;
+  for (i = 0; i < 8; i++)
+    FREE(v[i],64000);
+  // Without a decay delay, later calls purge on their own
+  SET_PURGE(PURGE_THRESHOLD, 0);
+  for (j = 0; j < 4 * PURGE_INTERVAL; j++){
+    ADDRS p = MALLOC(1000);
+    if (!p)
+      return ERROR_OUT_OF_MEM;
+    FREE(p,1000);
+  }
+  SET_PURGE(PURGE_THRESHOLD, PURGE_DECAY);
+  HEAP_STATS(&st2);
+  #ifndef HUGE_PAGES
+  if (st2.purged_bytes <= st1.purged_bytes)
+    err |= ERROR_DATA_INCON;
+  #endif
+  #if !defined(VHEAP) && !defined(HUGE_PAGES)
+  // Blocks freed under the threshold are purged once it is lowered, zeroed
+  // payloads don't pass for purged ones. On a fresh heap the blocks and the
+  // spacers between them are laid out in order.
+  ADDRS w[8];
+  INIT(mem_size);
+  for (i = 0; i < 8; i++){
+    if (!(w[i] = MALLOC((i % 2) ? 100 : 32000)))
+      return ERROR_OUT_OF_MEM;
+    if (!(i % 2))
+      memset(w[i], 0, 32000);
+  }
+  for (i = 0; i < 8; i += 2)
+    FREE(w[i],32000);
+  PURGE();
+  SET_PURGE(4096, PURGE_DECAY);
+  if (PURGE() < 4*4*4096)
+    err |= ERROR_DATA_INCON;
+  SET_PURGE(PURGE_THRESHOLD, PURGE_DECAY);
+  for (i = 1; i < 8; i += 2)
+    FREE(w[i],100);
+  #else
+  (void)mem_size;
+  #endif
+  return err;
+}
+
+#ifdef VHEAP
+int test_locality(){
+  ADDRS v[32];
+  int i, j, err = 0;
+  VSetLocality(1);
+  for (i = 0; i < 32; i++){
+    if (!(v[i] = MALLOC(100)))
+      return ERROR_OUT_OF_MEM;
+    memset(*v[i], i + 1, 100);
+  }
+  // Every fourth block is hot, freeing v[1] compacts and reorders
+  for (j = 0; j < 16; j++)
+    for (i = 0; i < 32; i += 4)
+      VTouch(v[i]);
+  FREE(v[1],100);
+  for (i = 4; i < 32; i += 4)
+    if (LOCATION_OF(v[i]) <= LOCATION_OF(v[i-4]))
+      err |= ERROR_NOT_FF;
+  for (i = 2; i < 32; i++)
+    if ((i % 4) && LOCATION_OF(v[i]) < LOCATION_OF(v[28]))
+      err |= ERROR_NOT_FF;
+  for (i = 0; i < 32; i++)
+    if (i != 1 && ((*v[i])[0] != i + 1 || (*v[i])[99] != i + 1))
+      err |= ERROR_DATA_INCON;
+  for (i = 0; i < 32; i++)
+    if (i != 1)
+      FREE(v[i],100);
+  // An incremental slice moves no more than its budget, a block over at most,
+  // hot blocks are only reordered by a full compaction
+  size_t at[32];
+  int moved = 0;
+  VSetCompaction(COMPACT_INCREMENTAL, 25, 512);
+  for (i = 0; i < 32; i++)
+    if (!(v[i] = MALLOC(100)))
+      return ERROR_OUT_OF_MEM;
+  for (j = 0; j < 16; j++)
+    for (i = 0; i < 32; i += 4)
+      VTouch(v[i]);
+  for (i = 0; i < 32; i++)
+    at[i] = LOCATION_OF(v[i]);
+  FREE(v[1],100);
+  for (i = 2; i < 32; i++)
+    if (LOCATION_OF(v[i]) != at[i])
+      moved++;
+  if (moved == 0 || moved * 100 > 512 + 100)
+    err |= ERROR_NOT_FF;
+  VSetCompaction(COMPACT_EAGER, 25, 4096);
+  for (i = 0; i < 32; i++)
+    if (i != 1)
+      FREE(v[i],100);
+  VSetLocality(0);
+  return err;
+}
+
+// Checks the 16 records listed in the root block of a reopened heap file
+int check_records(){
+  long idx[16];
+  ADDRS root = VRoot();
+  int i, err = 0;
+  if (!root)
+    return ERROR_DATA_INCON;
+  memcpy(idx, *root, sizeof(idx));
+  for (i = 0; i < 16; i++){
+    ADDRS r = VHandleAt(idx[i]);
+    if (!r || (*r)[0] != i + 1 || (*r)[7 + 3*i] != i + 1)
+      err |= ERROR_DATA_INCON;
+  }
+  return err;
+}
+
+int persist_records(const char *path, unsigned mem_size){
+  struct heap_file hdr;
+  size_t rt_off, align_off, m2_off, len, off, blk_len = 0;
+  size_t page = sysconf(_SC_PAGESIZE);
+  char *want, *blk = MAP_FAILED;
+  long idx[16];
+  int i, fd, out, null, opened, err = 0;
+  if (VOpen(path, mem_size) != 0)
+    err |= ERROR_DATA_INCON;
+  // The root block lists the RT indices of the records
+  ADDRS root = MALLOC(sizeof(idx));
+  if (!root)
+    return ERROR_OUT_OF_MEM;
+  for (i = 0; i < 16; i++){
+    char rec[64];
+    memset(rec, i + 1, sizeof(rec));
+    ADDRS r = PUT(rec, 8 + 3*i);
+    if (!r)
+      return ERROR_OUT_OF_MEM;
+    idx[i] = VHandleIndex(r);
+  }
+  memcpy(*root, idx, sizeof(idx));
+  VSetRoot(root);
+  VSync();
+  // Reopening brings back the records as of the sync
+  if (VOpen(path, 0) != 1)
+    err |= ERROR_DATA_INCON;
+  err |= check_records();
+  // With part of the old address range taken, the file maps elsewhere and
+  // the RT entries are rebased
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || pread(fd, &hdr, sizeof(hdr), 0) != sizeof(hdr)){
+    if (fd >= 0)
+      close(fd);
+    return err | ERROR_DATA_INCON;
+  }
+  close(fd);
+  len = file_layout(hdr.size, hdr.rt_cap, &rt_off, &align_off, &m2_off);
+  INIT(mem_size); // drops the mapping of the file, the new M2 may take some of it
+  for (off = 0; blk == MAP_FAILED && off < len; off += page){
+    blk_len = off ? page : len; // the whole range, or the first free page of it
+    want = hdr.base - m2_off + off;
+    blk = mmap(want, blk_len, PROT_NONE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED_NOREPLACE, -1, 0);
+    if (blk != MAP_FAILED && blk != want){
+      munmap(blk, blk_len);
+      blk = MAP_FAILED;
+    }
+  }
+  if (VOpen(path, 0) != 1 || heap_lo == hdr.base)
+    err |= ERROR_DATA_INCON;
+  err |= check_records();
+  if (blk != MAP_FAILED)
+    munmap(blk, blk_len);
+  // Changes after the last sync start the heap over. VOpen says so on
+  // stdout, which is kept out of the result line.
+  MALLOC(100);
+  fflush(stdout);
+  out = dup(1);
+  if ((null = open("/dev/null", O_WRONLY)) >= 0){
+    dup2(null, 1);
+    close(null);
+  }
+  opened = VOpen(path, mem_size);
+  fflush(stdout);
+  if (out >= 0){
+    dup2(out, 1);
+    close(out);
+  }
+  if (opened != 0 || VRoot() != NULL)
+    err |= ERROR_DATA_INCON;
+  return err;
+}
+
+int test_persist(unsigned mem_size){
+  char path[] = "/tmp/pa32heapXXXXXX";
+  int err, fd = mkstemp(path);
+  if (fd < 0)
+    return ERROR_OUT_OF_MEM;
+  close(fd);
+  err = persist_records(path, mem_size);
+  INIT(mem_size);
+  unlink(path);
+  return err;
+}
+#endif
+
+#if defined(HEAP_PROFILE) && !defined(VHEAP)
+// Samples two call sites and dumps the profile to path
+int sample_profile(const char *path, unsigned mem_size){
+  struct prof_site sites[8];
+  ADDRS v[200];
+  char line[256];
+  double live = 0, alloc = 0;
+  int i, n, maps = 0, err = 0;
+  // A fresh heap starts a fresh profile, sampling about every 4 KB
+  INIT(mem_size);
+  SetProfileRate(4096);
+  for (i = 0; i < 200; i++)
+    if (!(v[i] = MALLOC(1000)))
+      return ERROR_OUT_OF_MEM;
+  for (i = 0; i < 200; i++){
+    ADDRS p = MALLOC(1000);
+    if (!p)
+      return ERROR_OUT_OF_MEM;
+    FREE(p,1000);
+  }
+  // Two call sites, the one keeping its blocks has all the live bytes
+  n = ProfileSites(sites, 8);
+  for (i = 0; i < n; i++){
+    live += sites[i].live_bytes;
+    alloc += sites[i].alloc_bytes;
+  }
+  if (n != 2 || sites[1].live_samples != 0 || sites[1].alloc_samples == 0 ||
+      live < 50000 || live > 400000 || alloc < 150000 || alloc > 800000 || sites[0].alloc_rate <= 0)
+    err |= ERROR_DATA_INCON;
+  if (DumpProfile(path) != 0)
+    err |= ERROR_DATA_INCON;
+  else {
+    FILE *f = fopen(path, "r");
+    if (!f || !fgets(line, sizeof(line), f) || strncmp(line, "heap profile: ", 14))
+      err |= ERROR_DATA_INCON;
+    while (f && fgets(line, sizeof(line), f))
+      maps |= !strcmp(line, "MAPPED_LIBRARIES:\n");
+    if (!maps)
+      err |= ERROR_DATA_INCON;
+    if (f)
+      fclose(f);
+  }
+  // Freed blocks leave the profile
+  for (i = 0; i < 200; i++)
+    FREE(v[i],1000);
+  if (ProfileSites(sites, 8) != 2 || sites[0].live_bytes != 0 || sites[0].live_samples != 0)
+    err |= ERROR_DATA_INCON;
+  return err;
+}
+
+int test_profile(unsigned mem_size){
+  char path[] = "/tmp/pa31profXXXXXX";
+  int err, fd = mkstemp(path);
+  if (fd < 0)
+    return ERROR_OUT_OF_MEM;
+  close(fd);
+  err = sample_profile(path, mem_size);
+  SetProfileRate(PROF_RATE);
+  INIT(mem_size);
+  unlink(path);
+  return err;
+}
+#endif
+
+#ifndef VHEAP
+int test_fit_policies(unsigned mem_size){
+  int i, err = 0;
+  // Two free blocks of the same size class, the larger one freed last
+  ADDRS v1 = MALLOC(596);
+  ADDRS s1 = MALLOC(8);
+  ADDRS v2 = MALLOC(996);
+  ADDRS s2 = MALLOC(8);
+  if (!v1 || !s1 || !v2 || !s2)
+    return ERROR_OUT_OF_MEM;
+  FREE(v1,596);
+  FREE(v2,996);
+  SetFitPolicy(FIT_BEST);
+  ADDRS v3 = MALLOC(590);
+  if (LOCATION_OF(v3) != LOCATION_OF(v1))
+    err |= ERROR_NOT_FF;
+  SetFitPolicy(FIT_POLICY);
+  // Clean-up
+  FREE(v3,590);
+  FREE(s1,8);
+  FREE(s2,8);
+
+  // On a fresh heap, blocks of one size class between spacers. Free lists
+  // are LIFO, or sorted by address with ADDRESS_ORDERED.
+  #ifdef ADDRESS_ORDERED
+  int lifo = 0;
+  #else
+  int lifo = 1;
+  #endif
+  ADDRS p[5], sp[5];
+  INIT(mem_size);
+  for (i = 0; i < 5; i++){
+    p[i] = MALLOC(i == 2 ? 900 : 600);
+    sp[i] = MALLOC(300);
+    if (!p[i] || !sp[i])
+      return ERROR_OUT_OF_MEM;
+  }
+  for (i = 0; i < 5; i++)
+    FREE(p[i],600);
+  // Next fit: only p[2] fits 800 bytes, the rover moves past it onto
+  // p[1] or p[3]. Freeing the spacers next to p[2] coalesces p[1] and p[3]
+  // with their neighbours, and the rover moves on past them.
+  SetFitPolicy(FIT_NEXT);
+  ADDRS x = MALLOC(800);
+  FREE(sp[1],300);
+  FREE(sp[2],300);
+  ADDRS y = MALLOC(600);
+  if (x != p[2] || y != (lifo ? p[0] : p[4]))
+    err |= ERROR_NOT_FF;
+  SetFitPolicy(FIT_POLICY);
+
+  // Good fit: the smallest block is the last of GOOD_FIT_PROBES + 2 fits in
+  // its list, so good fit takes the first block and best fit the smallest
+  ADDRS q[GOOD_FIT_PROBES + 2], sq[GOOD_FIT_PROBES + 2];
+  int n = GOOD_FIT_PROBES + 2, last = lifo ? 0 : n - 1;
+  INIT(mem_size);
+  for (i = 0; i < n; i++){
+    q[i] = MALLOC(i == last ? 610 : 700);
+    sq[i] = MALLOC(300);
+    if (!q[i] || !sq[i])
+      return ERROR_OUT_OF_MEM;
+  }
+  for (i = 0; i < n; i++)
+    FREE(q[i],700);
+  SetFitPolicy(FIT_GOOD);
+  ADDRS g = MALLOC(600);
+  if (g != q[n - 1 - last])
+    err |= ERROR_NOT_FF;
+  FREE(g,600);
+  SetFitPolicy(FIT_BEST);
+  ADDRS b = MALLOC(600);
+  if (b != q[last])
+    err |= ERROR_NOT_FF;
+  SetFitPolicy(FIT_POLICY);
+  INIT(mem_size);
+  return err;
+}
+#endif
+
 int test_maxNumOfAlloc(){
   int count = 0;
   char *d = "x";
   const int testCap = 1000000;
   ADDRS allocs[testCap];
 
-  while ((allocs[count]=PUT(d,1)) && count < testCap){
+  while (count < testCap && (allocs[count]=PUT(d,1))){
     if (DATA_OF(allocs[count])!='x') break;
     count++;
   }
@@ -161,16 +634,497 @@ int test_maxSizeOfAlloc(int size){
   }
 }
 
+int test_realloc(){
+  int i, err = 0;
+  char data[512];
+  for (i = 0; i < 512; i++)
+    data[i] = (char)i;
+  // Grow a block followed by another allocation, then shrink it
+  ADDRS v1 = PUT(data, 100);
+  ADDRS v2 = PUT(data, 100);
+  if (!v1 || !v2)
+    return ERROR_OUT_OF_MEM;
+  v1 = REALLOC(v1, 512);
+  if (!v1)
+    return ERROR_OUT_OF_MEM;
+  if (memcmp((char *)LOCATION_OF(v1), data, 100) || memcmp((char *)LOCATION_OF(v2), data, 100))
+    err |= ERROR_DATA_INCON;
+  if (LOCATION_OF(v1) & (ALIGN-1))
+    err |= ERROR_ALIGMENT;
+  memcpy((char *)LOCATION_OF(v1), data, 512);
+  v1 = REALLOC(v1, 40);
+  if (!v1 || memcmp((char *)LOCATION_OF(v1), data, 40))
+    err |= ERROR_DATA_INCON;
+  // Clean-up
+  FREE(v1,40);
+  FREE(v2,100);
+  return err;
+}
+
+int test_batch(){
+  int i, j, err = 0;
+  ADDRS v[64];
+  ADDRS odd[32];
+  if (MALLOC_BATCH(24, 64, v) != 64)
+    return ERROR_OUT_OF_MEM;
+  for (i = 0; i < 64; i++){
+    if (LOCATION_OF(v[i]) & (ALIGN-1))
+      err |= ERROR_ALIGMENT;
+    memset((char *)LOCATION_OF(v[i]), i, 24);
+  }
+  // Free every other block in one batch, the rest must be intact
+  for (i = 0; i < 32; i++)
+    odd[i] = v[2*i+1];
+  FREE_BATCH(odd, 32);
+  for (i = 0; i < 64; i += 2)
+    for (j = 0; j < 24; j++)
+      if (((char *)LOCATION_OF(v[i]))[j] != (char)i)
+        err |= ERROR_DATA_INCON;
+  for (i = 0; i < 32; i++)
+    odd[i] = v[2*i];
+  FREE_BATCH(odd, 32);
+  // Batches larger than one sorted chunk, freed in reverse address order
+  ADDRS w[600], half[300];
+  if (MALLOC_BATCH(100, 600, w) != 600)
+    return ERROR_OUT_OF_MEM;
+  for (i = 0; i < 600; i++)
+    memset((char *)LOCATION_OF(w[i]), i, 100);
+  for (i = 0; i < 300; i++)
+    half[i] = w[599 - 2*i];
+  FREE_BATCH(half, 300);
+  for (i = 0; i < 600; i += 2)
+    for (j = 0; j < 100; j++)
+      if (((char *)LOCATION_OF(w[i]))[j] != (char)i)
+        err |= ERROR_DATA_INCON;
+  for (i = 0; i < 300; i++)
+    half[i] = w[598 - 2*i];
+  FREE_BATCH(half, 300);
+  return err;
+}
+
+int test_zerocopy(){
+  int i, err = 0;
+  // Write a record in place, committing less than was reserved
+  ADDRS v1 = RESERVE(256);
+  if (!v1)
+    return ERROR_OUT_OF_MEM;
+  char *w = (char *)LOCATION_OF(v1);
+  for (i = 0; i < 100; i++)
+    w[i] = (char)i;
+  v1 = COMMIT(v1, 100);
+  ADDRS v2 = PUT("x", 2);
+  if (!v1 || !v2)
+    return ERROR_OUT_OF_MEM;
+  // Read it in place
+  char *r = (char *)BORROW(v1);
+  for (i = 0; i < 100; i++)
+    if (r[i] != (char)i)
+      err |= ERROR_DATA_INCON;
+  RELEASE(v1);
+  FREE(v2,2);
+  return err;
+}
+
+#ifdef VHEAP
+int test_pinning(){
+  int i, err = 0;
+  ADDRS v1 = MALLOC(64);
+  ADDRS v2 = MALLOC(64);
+  ADDRS v3 = MALLOC(64);
+  if (!v1 || !v2 || !v3)
+    return ERROR_OUT_OF_MEM;
+  memset(*v2, 2, 64);
+  memset(*v3, 3, 64);
+  #ifdef BACKGROUND_COMPACT
+  VStartCompactor();
+  #endif
+  // A pinned block stays put while the blocks around it are freed
+  char *p = VPin(v2);
+  FREE(v1,64);
+  if (*v2 != p)
+    err |= ERROR_DATA_INCON;
+  for (i = 0; i < 64; i++)
+    if (p[i] != 2 || (*v3)[i] != 3)
+      err |= ERROR_DATA_INCON;
+  VUnpin(v2);
+  #ifdef BACKGROUND_COMPACT
+  VStopCompactor();
+  #endif
+  for (i = 0; i < 64; i++)
+    if ((*v2)[i] != 2 || (*v3)[i] != 3)
+      err |= ERROR_DATA_INCON;
+  FREE(v2,64);
+  FREE(v3,64);
+  return err;
+}
+#endif
+
+// Trace replay: each line of a trace is "a id size", "f id" or "r id size".
+// Other lines are skipped, so traces can carry comments.
+struct trace_op {
+  char op;
+  int id;
+  size_t size;
+};
+
+int load_trace(const char *path, struct trace_op **ops, int *maxId){
+  FILE *f = fopen(path, "r");
+  char line[128];
+  int n = 0, cap = 1024;
+  if (!f) return -1;
+  *ops = malloc(cap * sizeof(struct trace_op));
+  *maxId = -1;
+  while (fgets(line, sizeof(line), f)){
+    struct trace_op t;
+    unsigned long size = 0;
+    if (sscanf(line, " %c %d %lu", &t.op, &t.id, &size) < 2 || t.id < 0) continue;
+    if (t.op != 'a' && t.op != 'f' && t.op != 'r') continue;
+    t.size = size;
+    if (n == cap){
+      cap *= 2;
+      *ops = realloc(*ops, cap * sizeof(struct trace_op));
+    }
+    (*ops)[n++] = t;
+    if (t.id > *maxId) *maxId = t.id;
+  }
+  fclose(f);
+  return n;
+}
+
+// Bytes of the heap in use, up to the end of its last allocated block
+size_t heap_bytes(){
+#ifdef VHEAP
+  return baseptr - heap_lo;
+#else
+  size_t bytes = 0;
+  int i;
+  for (i = 0; i < NUM_ARENAS; i++){
+    char *end = arenas[i].hi - WSIZE; // epilogue header
+    if (!arenas[i].lo) continue;
+    if (!(*(word_t *)end & PREV_ALLOC))
+      end -= *(word_t *)(end - WSIZE) & ~0x7;
+    bytes += end - (arenas[i].lo - WSIZE);
+  }
+  return bytes;
+#endif
+}
+
+// Replays n trace ops on a fresh heap, returns the number of failed requests.
+// With peakPayload set it also tracks peak live payload and heap bytes,
+// which slows the replay down, so timing runs leave it NULL.
+int replay_trace(struct trace_op *ops, int n, int maxId, size_t *peakPayload, size_t *peakHeap){
+  ADDRS *live = calloc(maxId + 1, sizeof(ADDRS));
+  size_t *sizes = calloc(maxId + 1, sizeof(size_t));
+  size_t payload = 0, mapped = 0;
+  int i, fails = 0;
+  for (i = 0; i < n; i++){
+    struct trace_op *t = &ops[i];
+    ADDRS p = live[t->id];
+    if (peakPayload && p) mapped -= MAPPED_BYTES(p);
+    if (p && t->op != 'r'){ // free, an 'a' of a live id replaces it
+      FREE(p, sizes[t->id]);
+      payload -= sizes[t->id];
+      live[t->id] = p = NULL;
+    }
+    if (t->op == 'a' || t->op == 'r'){
+      ADDRS q = (t->op == 'a') ? MALLOC(t->size) : REALLOC(p, t->size);
+      if (q || !t->size){
+        payload += t->size - (p ? sizes[t->id] : 0);
+        live[t->id] = q;
+        sizes[t->id] = q ? t->size : 0;
+      }else
+        fails++;
+    }
+    if (peakPayload){
+      if (live[t->id]) mapped += MAPPED_BYTES(live[t->id]);
+      if (payload > *peakPayload) *peakPayload = payload;
+      if (heap_bytes() + mapped > *peakHeap) *peakHeap = heap_bytes() + mapped;
+    }
+  }
+  for (i = 0; i <= maxId; i++)
+    if (live[i]) FREE(live[i], sizes[i]);
+  free(live);
+  free(sizes);
+  return fails;
+}
+
+int bench_trace(const char *path, unsigned mem_size){
+  struct trace_op *ops;
+  struct timespec start, finish;
+  size_t peakPayload = 0, peakHeap = 0;
+  int maxId, fails;
+  int n = load_trace(path, &ops, &maxId);
+  if (n < 0){
+    fprintf(stderr, "can't open trace %s\n", path);
+    return 1;
+  }
+  printf("Replaying %d requests of %s...\n", n, path);
+#ifdef VHEAP
+  int policy = 0, policies = 1;
+#else
+  // The heap replays the trace once per placement policy
+  const char *names[FIT_POLICIES] = {"First fit", "Next fit", "Best fit", "Good fit"};
+  struct fit_stats fs;
+  int policy, policies = FIT_POLICIES;
+#endif
+  for (policy = 0; policy < policies; policy++){
+#ifndef VHEAP
+    SetFitPolicy(policy);
+    printf("%s:\n", names[policy]);
+#endif
+    // Timed run
+    INIT(mem_size);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    fails = replay_trace(ops, n, maxId, NULL, NULL);
+    clock_gettime(CLOCK_MONOTONIC, &finish);
+    double secs = (finish.tv_sec - start.tv_sec) + (finish.tv_nsec - start.tv_nsec) / 1e9;
+#ifndef VHEAP
+    FitStats(policy, &fs);
+#endif
+    // Measured run
+    peakPayload = peakHeap = 0;
+    INIT(mem_size);
+    replay_trace(ops, n, maxId, &peakPayload, &peakHeap);
+    printf("\tFailed requests: %d\n", fails);
+    printf("\tOps per second: %.0f\n", secs > 0 ? n / secs : 0.0);
+    printf("\tPeak heap utilization: %zu KB, initial heap %u KB\n", peakHeap >> 10, mem_size >> 10);
+    printf("\tPeak payload to heap bytes: %.3f\n", peakHeap ? (double)peakPayload / peakHeap : 0.0);
+#ifndef VHEAP
+    printf("\tFree blocks probed per fit search: %.2f\n", fs.searches ? (double)fs.probes / fs.searches : 0.0);
+#endif
+  }
+#ifndef VHEAP
+  SetFitPolicy(FIT_POLICY);
+#endif
+  free(ops);
+  return 0;
+}
+
+// Threaded benchmarks: threadtest, larson and producer-consumer, each run
+// on the heap and on glibc malloc. Builds without CONCURRENT serialize the
+// heap behind one lock, whose waits count as lock contention.
+#define BENCH_ROUNDS      200
+#define BENCH_BATCH       100
+#define BENCH_SLOTS       256
+#define BENCH_LARSON_OPS  20000
+#define BENCH_QUEUE       1024
+#define BENCH_ITEMS       20000
+
+struct allocator {
+  const char *name;
+  void *(*alloc)(size_t size);
+  void (*release)(void *p);
+};
+
+#ifndef CONCURRENT
+static pthread_mutex_t big_lock = PTHREAD_MUTEX_INITIALIZER;
+static long big_lock_contended = 0, big_lock_wait_cycles = 0;
+#endif
+
+static void heap_lock(){
+#ifndef CONCURRENT
+  if (pthread_mutex_trylock(&big_lock)){
+    unsigned long long start, finish;
+    RDTSC(start);
+    pthread_mutex_lock(&big_lock);
+    RDTSC(finish);
+    big_lock_contended++;
+    big_lock_wait_cycles += finish - start;
+  }
+#endif
+}
+
+static void heap_unlock(){
+#ifndef CONCURRENT
+  pthread_mutex_unlock(&big_lock);
+#endif
+}
+
+static void *heap_alloc(size_t size){
+  heap_lock();
+  void *p = (void *)MALLOC(size);
+  heap_unlock();
+  return p;
+}
+
+static void heap_release(void *p){
+  heap_lock();
+  FREE((ADDRS)p, 0);
+  heap_unlock();
+}
+
+static void libc_release(void *p){
+  free(p);
+}
+
+static void lock_contention(long *contended, long *wait_cycles){
+#ifdef CONCURRENT
+  LockContention(contended, wait_cycles);
+#else
+  *contended = big_lock_contended;
+  *wait_cycles = big_lock_wait_cycles;
+#endif
+}
+
+struct bench_arg {
+  struct allocator *a;
+  pthread_barrier_t *start;
+  void **slots;       // larson: blocks handed over by the main thread
+  void **queue;       // producer-consumer: ring buffer shared by a pair
+  unsigned head, tail;
+  unsigned seed;
+  long ops;
+};
+
+// Each thread repeatedly allocates a batch of objects and frees them all
+static void *threadtest_worker(void *v){
+  struct bench_arg *arg = v;
+  void *objs[BENCH_BATCH];
+  int r, i;
+  pthread_barrier_wait(arg->start);
+  for (r = 0; r < BENCH_ROUNDS; r++){
+    for (i = 0; i < BENCH_BATCH; i++)
+      objs[i] = arg->a->alloc(64);
+    for (i = 0; i < BENCH_BATCH; i++)
+      if (objs[i]) arg->a->release(objs[i]);
+  }
+  arg->ops = 2L * BENCH_ROUNDS * BENCH_BATCH;
+  return NULL;
+}
+
+// Each thread replaces random blocks of a set first allocated by the main
+// thread, so most frees hit blocks of another thread
+static void *larson_worker(void *v){
+  struct bench_arg *arg = v;
+  int i;
+  pthread_barrier_wait(arg->start);
+  for (i = 0; i < BENCH_LARSON_OPS; i++){
+    int k = rand_r(&arg->seed) % BENCH_SLOTS;
+    if (arg->slots[k]) arg->a->release(arg->slots[k]);
+    arg->slots[k] = arg->a->alloc(16 + rand_r(&arg->seed) % 113);
+  }
+  arg->ops = 2L * BENCH_LARSON_OPS;
+  return NULL;
+}
+
+// Producers allocate and hand blocks to their consumer, which frees them
+static void *producer_worker(void *v){
+  struct bench_arg *arg = v;
+  unsigned i;
+  pthread_barrier_wait(arg->start);
+  for (i = 0; i < BENCH_ITEMS; i++){
+    void *p = arg->a->alloc(16 + i % 241);
+    while (i - __atomic_load_n(&arg->tail, __ATOMIC_ACQUIRE) >= BENCH_QUEUE)
+      sched_yield();
+    arg->queue[i % BENCH_QUEUE] = p;
+    __atomic_store_n(&arg->head, i + 1, __ATOMIC_RELEASE);
+  }
+  arg->ops = 2L * BENCH_ITEMS; // the consumer's frees included
+  return NULL;
+}
+
+static void *consumer_worker(void *v){
+  struct bench_arg *arg = v;
+  unsigned i;
+  pthread_barrier_wait(arg->start);
+  for (i = 0; i < BENCH_ITEMS; i++){
+    while (__atomic_load_n(&arg->head, __ATOMIC_ACQUIRE) == i)
+      sched_yield();
+    void *p = arg->queue[i % BENCH_QUEUE];
+    __atomic_store_n(&arg->tail, i + 1, __ATOMIC_RELEASE);
+    if (p) arg->a->release(p);
+  }
+  return NULL;
+}
+
+// Runs one benchmark on nthreads threads, returns ops per second.
+// Producer-consumer takes an even number of threads.
+double run_bench(int bench, struct allocator *a, int nthreads){
+  pthread_t tids[nthreads];
+  struct bench_arg args[nthreads];
+  pthread_barrier_t start;
+  struct timespec t0, t1;
+  long ops = 0;
+  int i, k;
+  pthread_barrier_init(&start, NULL, nthreads + 1);
+  memset(args, 0, sizeof(args));
+  for (i = 0; i < nthreads; i++){
+    args[i].a = a;
+    args[i].start = &start;
+    args[i].seed = i + 1;
+    if (bench == 1){
+      args[i].slots = calloc(BENCH_SLOTS, sizeof(void *));
+      for (k = 0; k < BENCH_SLOTS; k++)
+        args[i].slots[k] = a->alloc(16 + k % 113);
+    }
+    if (bench == 2 && !(i & 1))
+      args[i].queue = malloc(BENCH_QUEUE * sizeof(void *));
+  }
+  for (i = 0; i < nthreads; i++){
+    void *(*worker)(void *) = bench == 0 ? threadtest_worker : bench == 1 ? larson_worker :
+      (i & 1) ? consumer_worker : producer_worker;
+    if (bench == 2 && (i & 1)){ // consumer shares its producer's queue
+      pthread_create(&tids[i], NULL, worker, &args[i - 1]);
+      continue;
+    }
+    pthread_create(&tids[i], NULL, worker, &args[i]);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &t0);
+  pthread_barrier_wait(&start);
+  for (i = 0; i < nthreads; i++)
+    pthread_join(tids[i], NULL);
+  clock_gettime(CLOCK_MONOTONIC, &t1);
+  for (i = 0; i < nthreads; i++){
+    ops += args[i].ops;
+    if (args[i].slots){
+      for (k = 0; k < BENCH_SLOTS; k++)
+        if (args[i].slots[k]) a->release(args[i].slots[k]);
+      free(args[i].slots);
+    }
+    free(args[i].queue);
+  }
+  pthread_barrier_destroy(&start);
+  double secs = (t1.tv_sec - t0.tv_sec) + (t1.tv_nsec - t0.tv_nsec) / 1e9;
+  return secs > 0 ? ops / secs : 0;
+}
+
+int bench_threads(int maxThreads, unsigned mem_size){
+  const char *names[3] = {"threadtest", "larson", "producer-consumer"};
+  struct allocator heap = {TESTSUITE_STR, heap_alloc, heap_release};
+  struct allocator libc = {"glibc", malloc, libc_release};
+  int bench, n;
+  INIT(mem_size);
+  printf("Threaded benchmarks, ops per second:\n");
+  for (bench = 0; bench < 3; bench++){
+    int first = (bench == 2) ? 2 : 1;
+    int last = (bench == 2) ? (maxThreads < 2 ? 2 : maxThreads & ~1) : maxThreads;
+    for (n = first; n <= last; n = (n < last && n * 2 > last) ? last : n * 2){
+      long contended0, wait0, contended1, wait1;
+      lock_contention(&contended0, &wait0);
+      double h = run_bench(bench, &heap, n);
+      lock_contention(&contended1, &wait1);
+      double g = run_bench(bench, &libc, n);
+      printf("\t%-18s %3d threads: %s %10.0f  glibc %10.0f  contended locks %ld, wait cycles %ld\n",
+        names[bench], n, TESTSUITE_STR, h, g, contended1 - contended0, wait1 - wait0);
+    }
+  }
+  return 0;
+}
+
 int main (int argc, char **argv) {
   int res;
   unsigned mem_size = (1<<20); // Default
   // Parse the arguments
-  if (argc > 2){
-    fprintf(stderr, "Usage: %s [buffer size in bytes]\n",argv[0]);
+  if (argc > 4 || (argc == 4 && strcmp(argv[2], "-t"))){
+    fprintf(stderr, "Usage: %s [buffer size in bytes] [trace file | -t threads]\n",argv[0]);
     exit(1);
-  }else if (argc == 2){
+  }else if (argc >= 2){
     mem_size = atoi(argv[1]);
   }
+  if (argc >= 3 && !strcmp(argv[2], "-t"))
+    return bench_threads(argc == 4 ? atoi(argv[3]) : 8, mem_size);
+  if (argc == 3)
+    return bench_trace(argv[2], mem_size);
 
   printf("Evaluating a %s of %d KBs...\n",TESTSUITE_STR,mem_size/1024);
 
@@ -184,8 +1138,15 @@ int main (int argc, char **argv) {
   printf("\tAverage clock cycles for a Malloc request: %lu\n",tot_alloc_time/numIterations);
   printf("\tAverage clock cycles for a Free request: %lu\n",tot_free_time/numIterations);
   printf("\tTotal clock cycles for %d Malloc/Free requests: %lu\n",numIterations,tot_alloc_time+tot_free_time);
+  #ifdef LATENCY_STATS
+  struct lat_stats st;
+  LATENCY(LAT_MALLOC,&st);
+  printf("\tMalloc clock cycles p50/p99/p999/max: %llu/%llu/%llu/%llu\n",st.p50,st.p99,st.p999,st.max);
+  LATENCY(LAT_FREE,&st);
+  printf("\tFree clock cycles p50/p99/p999/max: %llu/%llu/%llu/%llu\n",st.p50,st.p99,st.p999,st.max);
+  #endif
   // Test 2
-  #ifndef VHEAP
+  #if !defined(VHEAP) && !defined(SLAB_TIER) && !defined(CONCURRENT)
   printf("Test 2 - First-fit policy:\t\t");
   print_testResult(test_ff());
   #endif
@@ -195,5 +1156,46 @@ int main (int argc, char **argv) {
   // Test 4:
   printf("Test 4 - Max allocation size:\t\t");
   printf("[%s%i KB%s]\n", KBLU, test_maxSizeOfAlloc(4*1024*1024)>>10, KRESET);
+  // Test 5: on a fresh heap, test 4 leaves the old one full
+  INIT(mem_size);
+  printf("Test 5 - Resizing allocations:\t\t");
+  print_testResult(test_realloc());
+  // Test 6
+  printf("Test 6 - Batch allocations:\t\t");
+  print_testResult(test_batch());
+  // Test 7
+  printf("Test 7 - Zero-copy records:\t\t");
+  print_testResult(test_zerocopy());
+  #ifndef VHEAP
+  // Test 8
+  printf("Test 8 - Fit policies:\t\t");
+  print_testResult(test_fit_policies(mem_size));
+  #else
+  // Test 8
+  printf("Test 8 - Pinned handles:\t\t");
+  print_testResult(test_pinning());
+  #endif
+  // Test 9
+  printf("Test 9 - Aligned allocations:\t\t");
+  print_testResult(test_aligned());
+  // Test 10
+  printf("Test 10 - Heap statistics:\t\t");
+  print_testResult(test_stats());
+  // Test 11
+  printf("Test 11 - Purging free memory:\t\t");
+  print_testResult(test_purge(mem_size));
+  #ifdef VHEAP
+  // Test 12
+  printf("Test 12 - Hot block ordering:\t\t");
+  print_testResult(test_locality());
+  // Test 13
+  printf("Test 13 - Persistent heap:\t\t");
+  print_testResult(test_persist(mem_size));
+  #endif
+  #if defined(HEAP_PROFILE) && !defined(VHEAP)
+  // Test 14
+  printf("Test 14 - Sampling profiler:\t\t");
+  print_testResult(test_profile(mem_size));
+  #endif
   return 0;
 }
\ No newline at end of file